@@ -52,6 +52,8 @@
                 qemu
                 gnumake
                 curl
+                lz4
+                python3
               ];
               # To avoid Nix adding compiler flags that are not available on a freestanding
               # environment.
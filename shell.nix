@@ -8,6 +8,8 @@ in
     buildInputs = with pkgs.buildPackages; [
         qemu
         gnumake
+        lz4
+        python3
         cross.buildPackages.gcc9
     ];
 }
@@ -3,6 +3,7 @@
 #include <microkit.h>
 #include "printf.h"
 #include "wordle.h"
+#include "ring_buffer.h"
 
 #define SERIAL_CHANNEL 1
 #define WORDLE_CHANNEL 2
@@ -15,6 +16,10 @@ uintptr_t client_to_serial_vaddr;
 #define GREEN "\033[32;1;40m"
 #define YELLOW "\033[39;103m"
 #define DEFAULT_COLOUR "\033[0m"
+// Move the cursor up a given number of lines and then to a given column
+#define MOVE_CURSOR_TO_CELL "\033[%dA\033[%dG"
+// Move the cursor down a given number of lines and back to the first column
+#define MOVE_CURSOR_BELOW_TABLE "\033[%dB\033[1G"
 
 #define INVALID_CHAR (-1)
 
@@ -25,34 +30,163 @@ struct wordle_char {
 
 // Store game state
 static struct wordle_char table[NUM_TRIES][WORD_LENGTH];
+// What the table looked like when we last drew it on the terminal
+static struct wordle_char drawn[NUM_TRIES][WORD_LENGTH];
 // Use these global variables to keep track of the character index that the
 // player is currently trying to input.
 static int curr_row = 0;
 static int curr_letter = 0;
 
-void wordle_server_send() {
-    // Implement this function to send the word over PPC
+// Returns false if the Wordle server did not accept the word as a guess.
+bool wordle_server_send() {
+    // The whole guess fits in a single message register, see wordle.h for
+    // how it is packed.
+    char guess[WORD_LENGTH];
     for (int i = 0; i < WORD_LENGTH; i++) {
-        microkit_mr_set(i, table[curr_row][i].ch);
+        guess[i] = table[curr_row][i].ch;
     }
-    microkit_ppcall(WORDLE_CHANNEL, microkit_msginfo_new(0, WORD_LENGTH));
-    // After doing the PPC, the Wordle server should have updated
-    // the message-registers containing the state of each character.
-    // Look at the message registers and update the `table` accordingly.
+    microkit_mr_set(0, wordle_pack_word(guess));
+    microkit_msginfo reply = microkit_ppcall(WORDLE_CHANNEL, microkit_msginfo_new(WORDLE_LABEL(WORDLE_REQUEST_GUESS), 1));
+    if (microkit_msginfo_get_label(reply) != WORDLE_REPLY_VALID_WORD) {
+        return false;
+    }
+    // After doing the PPC, the Wordle server has replied with the state of
+    // each character, update the `table` accordingly.
+    enum character_state states[WORD_LENGTH];
+    wordle_unpack_states(microkit_mr_get(0), states);
     for (int i = 0; i < WORD_LENGTH; i++) {
-        table[curr_row][i].state = microkit_mr_get(i);
+        table[curr_row][i].state = states[i];
+    }
+
+    return true;
+}
+
+/*
+ * Everything we print for a frame (i.e one redraw of the table) is composed
+ * in this buffer first and then handed over to the serial server in one go,
+ * rather than copying each bracket, colour code and character into the ring
+ * separately.
+ */
+#define FRAME_SIZE 0x400
+static char frame[FRAME_SIZE];
+static uint32_t frame_len = 0;
+// How much of the frame the serial server's ring has taken so far.
+static uint32_t frame_sent = 0;
+
+/* Build with DEBUG_FRAME_STATS=1 to print out how much each frame cost. */
+struct frame_stats {
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t notifications;
+    uint64_t dropped;
+    /* For the current frame */
+    uint32_t frame_bytes;
+    uint32_t frame_notifications;
+    uint32_t frame_dropped;
+};
+static struct frame_stats frame_stats;
+
+// Copy as much of the frame as fits into the ring shared with the serial
+// server and let it know there is something to print. Returns false if some
+// of the frame is still waiting for room in the ring.
+static bool frame_write() {
+    struct ring_buffer *ring = (struct ring_buffer *)client_to_serial_vaddr;
+    uint32_t written = ring_buffer_write(ring, frame + frame_sent, frame_len - frame_sent);
+    if (frame_sent + written != frame_len) {
+        // The ring is full, and the serial server only drains it as fast as
+        // the UART sends. Rather than spinning, ask the server to notify us
+        // when there is room and carry on from there (see notified()).
+        ring_buffer_request_notify(ring);
+        written += ring_buffer_write(ring, frame + frame_sent + written, frame_len - frame_sent - written);
+    }
+    if (written != 0) {
+        microkit_notify(SERIAL_CHANNEL);
+        frame_stats.frame_notifications++;
+    }
+    frame_stats.frame_bytes += written;
+    frame_sent += written;
+    if (frame_sent == frame_len) {
+        frame_sent = 0;
+        frame_len = 0;
+        return true;
     }
+    // Move what is left to the start so there is room to add to the frame.
+    for (uint32_t i = frame_sent; i < frame_len; i++) {
+        frame[i - frame_sent] = frame[i];
+    }
+    frame_len -= frame_sent;
+    frame_sent = 0;
+    return false;
+}
+
+// Send the current frame to the serial server.
+void serial_flush() {
+    if (frame_len == 0) {
+        return;
+    }
+    frame_write();
+
+    frame_stats.frames++;
+    frame_stats.bytes += frame_stats.frame_bytes;
+    frame_stats.notifications += frame_stats.frame_notifications;
+#if defined(DEBUG_FRAME_STATS)
+    char stats[64];
+    snprintf(stats, sizeof(stats), "CLIENT|FRAME: %u bytes, %u notifications\n",
+             frame_stats.frame_bytes, frame_stats.frame_notifications);
+    microkit_dbg_puts(stats);
+#endif
+    if (frame_stats.frame_dropped != 0) {
+        char dropped[64];
+        snprintf(dropped, sizeof(dropped), "CLIENT|ERROR: dropped %u bytes of output\n", frame_stats.frame_dropped);
+        microkit_dbg_puts(dropped);
+        frame_stats.dropped += frame_stats.frame_dropped;
+    }
+    frame_stats.frame_bytes = 0;
+    frame_stats.frame_notifications = 0;
+    frame_stats.frame_dropped = 0;
 }
 
+// Add a string to the current frame. Nothing gets printed until
+// serial_flush() is called, so that a whole redraw only costs a single
+// notification.
 void serial_send(char *str) {
-    // Implement this function to get the serial server to print the string.
-    int i = 0;
-    while (str[i] != '\0') {
-        ((char *)client_to_serial_vaddr)[i] = str[i];
-        i++;
-    }
-    ((char *)client_to_serial_vaddr)[i] = '\0';
-    microkit_notify(SERIAL_CHANNEL);
+    while (*str != '\0') {
+        if (frame_len == FRAME_SIZE) {
+            // Frame is bigger than we expected, send what we have so far.
+            frame_write();
+            if (frame_len == FRAME_SIZE) {
+                // The serial server cannot take any of it either and we have
+                // no way of waiting here, so the rest is lost. Count it so
+                // that serial_flush() can report it.
+                while (*str++ != '\0') {
+                    frame_stats.frame_dropped++;
+                }
+                return;
+            }
+        }
+        frame[frame_len++] = *str++;
+    }
+}
+
+// Print the contents of a single cell of the table, i.e everything between
+// the square brackets.
+void print_cell(struct wordle_char *cell) {
+    if (cell->ch != INVALID_CHAR) {
+        switch (cell->state) {
+            case INCORRECT: break;
+            case CORRECT_PLACEMENT: serial_send(GREEN); break;
+            case INCORRECT_PLACEMENT: serial_send(YELLOW); break;
+            default:
+                // Print out error messages/debug info via debug output
+                microkit_dbg_puts("CLIENT|ERROR: unexpected character state\n");
+        }
+        char ch_str[] = { cell->ch, '\0' };
+        serial_send(ch_str);
+        // Reset colour
+        serial_send(DEFAULT_COLOUR);
+    } else {
+        serial_send(" ");
+    }
 }
 
 // This function prints a CLI Wordle using pretty colours for what characters
@@ -70,28 +204,43 @@ void print_table(bool clear_terminal) {
     for (int row = 0; row < NUM_TRIES; row++) {
         for (int letter = 0; letter < WORD_LENGTH; letter++) {
             serial_send("[");
-            enum character_state state = table[row][letter].state;
-            int ch = table[row][letter].ch;
-            if (ch != INVALID_CHAR) {
-                switch (state) {
-                    case INCORRECT: break;
-                    case CORRECT_PLACEMENT: serial_send(GREEN); break;
-                    case INCORRECT_PLACEMENT: serial_send(YELLOW); break;
-                    default:
-                        // Print out error messages/debug info via debug output
-                        microkit_dbg_puts("CLIENT|ERROR: unexpected character state\n");
-                }
-                char ch_str[] = { ch, '\0' };
-                serial_send(ch_str);
-                // Reset colour
-                serial_send(DEFAULT_COLOUR);
-            } else {
-                serial_send(" ");
-            }
+            print_cell(&table[row][letter]);
             serial_send("] ");
+            drawn[row][letter] = table[row][letter];
         }
         serial_send("\n");
     }
+    serial_flush();
+}
+
+// Instead of printing the whole table again, only print the cells that have
+// changed since the table was last drawn. For each changed cell, we move the
+// cursor up from the line below the table to the cell's row and across to
+// the cell's column, print the cell, and then move the cursor back to where
+// it started.
+void print_table_changes() {
+    bool changed = false;
+    for (int row = 0; row < NUM_TRIES; row++) {
+        for (int letter = 0; letter < WORD_LENGTH; letter++) {
+            struct wordle_char *cell = &table[row][letter];
+            if (cell->ch == drawn[row][letter].ch && cell->state == drawn[row][letter].state) {
+                continue;
+            }
+            char move[32];
+            // Each cell is printed as "[x] ", so the character of a cell is
+            // in column (letter * 4) + 2, counting from one.
+            snprintf(move, sizeof(move), MOVE_CURSOR_TO_CELL, NUM_TRIES - row, (letter * 4) + 2);
+            serial_send(move);
+            print_cell(cell);
+            snprintf(move, sizeof(move), MOVE_CURSOR_BELOW_TABLE, NUM_TRIES - row);
+            serial_send(move);
+            drawn[row][letter] = *cell;
+            changed = true;
+        }
+    }
+    if (changed) {
+        serial_flush();
+    }
 }
 
 void init_table() {
@@ -126,8 +275,9 @@ void add_char_to_table(char c) {
 
     // If the user has finished inputting a word, we want to send the
     // word to the server and move the cursor to the next row.
-    if (c == '\r' && curr_letter == WORD_LENGTH) {
-        wordle_server_send();
+    // If the word is not in the dictionary, we stay on the same row so the
+    // user can change their guess.
+    if (c == '\r' && curr_letter == WORD_LENGTH && wordle_server_send()) {
         curr_row += 1;
         curr_letter = 0;
     }
@@ -147,9 +297,31 @@ void init(void) {
 void notified(microkit_channel channel) {
     switch (channel) {
         case SERIAL_CHANNEL: {
-            char ch = ((char *)serial_to_client_vaddr)[0];
-            add_char_to_table(ch);
-            print_table(true);
+            // We also get notified when the serial server has made room for
+            // output that did not fit before. That has to go out before we
+            // draw anything else, so until it has, input stays in the ring.
+            if (frame_len != 0 && !frame_write()) {
+                break;
+            }
+            // There may be more than one character waiting for us, so add
+            // all of them before redrawing the table.
+            struct ring_buffer *ring = (struct ring_buffer *)serial_to_client_vaddr;
+            char buf[64];
+            uint32_t len;
+            int row = curr_row;
+            while ((len = ring_buffer_read(ring, buf, sizeof(buf))) != 0) {
+                for (uint32_t i = 0; i < len; i++) {
+                    add_char_to_table(buf[i]);
+                }
+            }
+            // When a word is submitted every cell in the row changes colour,
+            // so we may as well redraw the whole table. Otherwise only the
+            // cells that were typed or deleted need to be printed.
+            if (curr_row != row) {
+                print_table(true);
+            } else {
+                print_table_changes();
+            }
             break;
         }
     }
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * A single-producer/single-consumer ring buffer of bytes that lives at the
+ * start of a shared memory region between two protection domains.
+ *
+ * The producer is the only one that writes `tail` and the consumer is the only
+ * one that writes `head`. Both indices are free-running and are only masked
+ * when indexing into `data`, which means the ring is empty when they are equal
+ * and full when they are RING_BUFFER_SIZE apart. Since each index has exactly
+ * one writer, no locking is needed, we only need to make sure that the data is
+ * visible before the index that publishes it.
+ *
+ * The indices are kept on separate cache lines so that the producer and
+ * consumer are not fighting over the same line.
+ *
+ * When the ring is too full for the producer it can ask the consumer to
+ * notify it once it has taken something out, rather than polling for space.
+ */
+#define RING_BUFFER_SIZE 0x800
+#define RING_BUFFER_MASK (RING_BUFFER_SIZE - 1)
+
+_Static_assert((RING_BUFFER_SIZE & RING_BUFFER_MASK) == 0,
+               "ring buffer size must be a power of two");
+
+struct ring_buffer {
+    uint32_t head;
+    uint8_t pad0[60];
+    uint32_t tail;
+    uint32_t producer_waiting;
+    uint8_t pad1[56];
+    char data[RING_BUFFER_SIZE];
+};
+
+static inline uint32_t ring_buffer_used(struct ring_buffer *ring)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    return tail - head;
+}
+
+static inline uint32_t ring_buffer_free(struct ring_buffer *ring)
+{
+    return RING_BUFFER_SIZE - ring_buffer_used(ring);
+}
+
+static inline bool ring_buffer_empty(struct ring_buffer *ring)
+{
+    return ring_buffer_used(ring) == 0;
+}
+
+/*
+ * Producer side. Copies as many bytes of `buf` as there is space for and
+ * returns how many were copied.
+ */
+static inline uint32_t ring_buffer_write(struct ring_buffer *ring, const char *buf, uint32_t len)
+{
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t space = RING_BUFFER_SIZE - (tail - head);
+    if (len > space) {
+        len = space;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        ring->data[(tail + i) & RING_BUFFER_MASK] = buf[i];
+    }
+    /* Publish the data before the new tail. */
+    __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+
+    return len;
+}
+
+/*
+ * Consumer side. Copies up to `len` bytes out of the ring into `buf` and
+ * returns how many were copied.
+ */
+static inline uint32_t ring_buffer_read(struct ring_buffer *ring, char *buf, uint32_t len)
+{
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t used = tail - head;
+    if (len > used) {
+        len = used;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        buf[i] = ring->data[(head + i) & RING_BUFFER_MASK];
+    }
+    /* Only hand the space back to the producer once we are done reading it. */
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+
+    return len;
+}
+
+/*
+ * Producer side. Ask the consumer to notify us once it has made room. The
+ * consumer may have made room before it saw the request, so the producer has
+ * to check for space again afterwards.
+ */
+static inline void ring_buffer_request_notify(struct ring_buffer *ring)
+{
+    __atomic_store_n(&ring->producer_waiting, 1, __ATOMIC_RELAXED);
+    /* The request has to be visible before we look at `head` again. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * Consumer side. Returns whether the producer is waiting for room after
+ * something has been read out of the ring, and clears the request.
+ */
+static inline bool ring_buffer_notify_requested(struct ring_buffer *ring)
+{
+    /* Our update of `head` has to be visible before we look at the request. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_exchange_n(&ring->producer_waiting, 0, __ATOMIC_RELAXED) != 0;
+}
@@ -1,3 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
 #define NUM_TRIES 5
 #define WORD_LENGTH 5
 
@@ -6,3 +11,86 @@ enum character_state {
     INCORRECT_PLACEMENT = 1, // Correct character, in the incorrect index of the word.
     INCORRECT = 2, // Character does not appear in the word.
 };
+
+/*
+ * Protocol used between the client and the Wordle server.
+ *
+ * The label of a request holds the version of the protocol in its upper bits
+ * and the type of request in its lower bits, so that new requests can be added
+ * later without breaking older clients.
+ *
+ * A WORDLE_REQUEST_GUESS has a single message register containing the guess,
+ * packed 5 bits per letter ('a' is 0, 'z' is 25) with the first letter in the
+ * most significant bits. The reply has a single message register containing
+ * the state of each character of the guess, 2 bits per character with the
+ * first character in the least significant bits.
+ */
+#define WORDLE_PROTOCOL_VERSION 1
+
+#define WORDLE_LABEL_TYPE_BITS 8
+#define WORDLE_LABEL(type) ((WORDLE_PROTOCOL_VERSION << WORDLE_LABEL_TYPE_BITS) | (type))
+#define WORDLE_LABEL_VERSION(label) ((label) >> WORDLE_LABEL_TYPE_BITS)
+#define WORDLE_LABEL_TYPE(label) ((label) & ((1 << WORDLE_LABEL_TYPE_BITS) - 1))
+
+#define WORDLE_REQUEST_GUESS 0
+
+/*
+ * Labels used by the Wordle server when replying to a guess from the client.
+ * A valid guess is replied to with the state of each character, an invalid
+ * one (i.e not in the dictionary) with no message registers at all.
+ */
+#define WORDLE_REPLY_VALID_WORD 0
+#define WORDLE_REPLY_INVALID_WORD 1
+/* The request was malformed or from a version of the protocol we do not speak */
+#define WORDLE_REPLY_INVALID_REQUEST 2
+
+#define WORDLE_LETTER_BITS 5
+#define WORDLE_LETTER_MASK ((1 << WORDLE_LETTER_BITS) - 1)
+#define WORDLE_STATE_BITS 2
+#define WORDLE_STATE_MASK ((1 << WORDLE_STATE_BITS) - 1)
+
+static inline uint64_t wordle_pack_word(const char *word)
+{
+    uint64_t packed = 0;
+    for (int i = 0; i < WORD_LENGTH; i++) {
+        int ch = word[i];
+        if (ch >= 'A' && ch <= 'Z') {
+            ch = ch - 'A' + 'a';
+        }
+        packed = (packed << WORDLE_LETTER_BITS) | ((ch - 'a') & WORDLE_LETTER_MASK);
+    }
+    return packed;
+}
+
+/* Returns false if the packed word contains something that is not a letter. */
+static inline bool wordle_unpack_word(uint64_t packed, char *word)
+{
+    if (packed >> (WORD_LENGTH * WORDLE_LETTER_BITS)) {
+        return false;
+    }
+    for (int i = WORD_LENGTH - 1; i >= 0; i--) {
+        int letter = packed & WORDLE_LETTER_MASK;
+        if (letter > 'z' - 'a') {
+            return false;
+        }
+        word[i] = 'a' + letter;
+        packed >>= WORDLE_LETTER_BITS;
+    }
+    return true;
+}
+
+static inline uint64_t wordle_pack_states(const enum character_state *states)
+{
+    uint64_t packed = 0;
+    for (int i = 0; i < WORD_LENGTH; i++) {
+        packed |= (uint64_t)(states[i] & WORDLE_STATE_MASK) << (i * WORDLE_STATE_BITS);
+    }
+    return packed;
+}
+
+static inline void wordle_unpack_states(uint64_t packed, enum character_state *states)
+{
+    for (int i = 0; i < WORD_LENGTH; i++) {
+        states[i] = (packed >> (i * WORDLE_STATE_BITS)) & WORDLE_STATE_MASK;
+    }
+}
@@ -1,6 +1,8 @@
 #include <stdint.h>
+#include <stdbool.h>
 #include <microkit.h>
 #include "printf.h"
+#include "ring_buffer.h"
 
 // This variable will have the address of the UART device
 uintptr_t uart_base_vaddr;
@@ -8,15 +10,57 @@ uintptr_t uart_base_vaddr;
 #define RHR_MASK 0b111111111
 #define UARTDR 0x000
 #define UARTFR 0x018
+#define UARTLCR_H 0x02C
+#define UARTCR 0x030
+#define UARTIFLS 0x034
 #define UARTIMSC 0x038
+#define UARTMIS 0x040
 #define UARTICR 0x044
+#define PL011_UARTFR_BUSY (1 << 3)
 #define PL011_UARTFR_TXFF (1 << 5)
 #define PL011_UARTFR_RXFE (1 << 4)
+#define PL011_UARTLCR_H_FEN (1 << 4)
+#define PL011_UARTCR_UARTEN (1 << 0)
+#define PL011_INT_RX (1 << 4)
+#define PL011_INT_TX (1 << 5)
+#define PL011_INT_RT (1 << 6)
+/* Interrupt when the TX FIFO drains to 1/4 full, RX at the default of 1/2 full */
+#define PL011_UARTIFLS_TX_1_4 (0b001 << 0)
+#define PL011_UARTIFLS_RX_1_2 (0b010 << 3)
 
 #define REG_PTR(base, offset) ((volatile uint32_t *)((base) + (offset)))
 
+#define UART_IRQ_CH 1
+#define CLIENT_CH 2
+
+uintptr_t serial_to_client_vaddr;
+uintptr_t client_to_serial_vaddr;
+
+/*
+ * Characters waiting to go out on the UART. Rather than spinning until there
+ * is room in the hardware FIFO, we fill the FIFO as far as it will go and let
+ * the TX interrupt tell us when it has drained enough to take some more.
+ */
+static struct ring_buffer tx_queue;
+/*
+ * The rest of a string we are printing ourselves that did not fit in the TX
+ * queue. It goes out before any more of the client's output.
+ */
+static char *tx_waiting_str;
+
 void uart_init() {
-    *REG_PTR(uart_base_vaddr, UARTIMSC) = 0x50;
+    // The FIFOs can only be turned on while the UART is disabled, so wait
+    // for anything in flight to finish going out first.
+    uint32_t cr = *REG_PTR(uart_base_vaddr, UARTCR);
+    while ((*REG_PTR(uart_base_vaddr, UARTFR) & PL011_UARTFR_BUSY) != 0);
+    *REG_PTR(uart_base_vaddr, UARTCR) = cr & ~PL011_UARTCR_UARTEN;
+    *REG_PTR(uart_base_vaddr, UARTLCR_H) |= PL011_UARTLCR_H_FEN;
+    *REG_PTR(uart_base_vaddr, UARTIFLS) = PL011_UARTIFLS_TX_1_4 | PL011_UARTIFLS_RX_1_2;
+    *REG_PTR(uart_base_vaddr, UARTCR) = cr;
+
+    // Only RX interrupts to start with, TX is enabled when we have
+    // something to send.
+    *REG_PTR(uart_base_vaddr, UARTIMSC) = PL011_INT_RX | PL011_INT_RT;
 }
 
 int uart_get_char() {
@@ -40,13 +84,45 @@ int uart_get_char() {
     return ch;
 }
 
-void uart_put_char(int ch) {
-    while ((*REG_PTR(uart_base_vaddr, UARTFR) & PL011_UARTFR_TXFF) != 0);
+/*
+ * Move characters from the TX queue into the hardware FIFO until either the
+ * FIFO is full or we run out of characters. The TX interrupt is only left
+ * enabled while there is still something queued, otherwise an empty FIFO
+ * would keep interrupting us.
+ */
+static void uart_tx_fill() {
+    char ch;
+    while ((*REG_PTR(uart_base_vaddr, UARTFR) & PL011_UARTFR_TXFF) == 0) {
+        if (ring_buffer_read(&tx_queue, &ch, 1) == 0) {
+            break;
+        }
+        *REG_PTR(uart_base_vaddr, UARTDR) = ch;
+    }
+
+    if (ring_buffer_empty(&tx_queue)) {
+        *REG_PTR(uart_base_vaddr, UARTIMSC) &= ~PL011_INT_TX;
+    } else {
+        *REG_PTR(uart_base_vaddr, UARTIMSC) |= PL011_INT_TX;
+    }
+}
+
+// Returns false, without queueing anything, if the TX queue is full. Rather
+// than waiting for the UART, callers leave the character where it is and try
+// again once the TX interrupt has made room.
+bool uart_put_char(int ch) {
+    // A carriage return needs room for the newline that follows it.
+    if (ring_buffer_free(&tx_queue) < 2) {
+        return false;
+    }
 
-    *REG_PTR(uart_base_vaddr, UARTDR) = ch;
+    char c = ch;
+    ring_buffer_write(&tx_queue, &c, 1);
     if (ch == '\r') {
-        uart_put_char('\n');
+        c = '\n';
+        ring_buffer_write(&tx_queue, &c, 1);
     }
+
+    return true;
 }
 
 void uart_handle_irq() {
@@ -55,9 +131,77 @@ void uart_handle_irq() {
 
 void uart_put_str(char *str) {
     while (*str) {
-        uart_put_char(*str);
+        if (!uart_put_char(*str)) {
+            tx_waiting_str = str;
+            break;
+        }
         str++;
     }
+    uart_tx_fill();
+}
+
+/*
+ * Take as much of the client's output as will fit in the TX queue and start
+ * sending it. Whatever does not fit stays in the client's ring until the next
+ * TX interrupt makes room for it. If the client found its ring full, it is
+ * waiting for us to tell it that there is room again.
+ */
+static void serial_tx_pump() {
+    if (tx_waiting_str != NULL) {
+        char *str = tx_waiting_str;
+        tx_waiting_str = NULL;
+        uart_put_str(str);
+        if (tx_waiting_str != NULL) {
+            return;
+        }
+    }
+
+    struct ring_buffer *ring = (struct ring_buffer *)client_to_serial_vaddr;
+    char buf[64];
+    uint32_t len;
+    bool read = false;
+    // Every character can expand to two (see uart_put_char), so this always
+    // has room for everything it reads.
+    while (ring_buffer_free(&tx_queue) >= 2 * sizeof(buf)) {
+        len = ring_buffer_read(ring, buf, sizeof(buf));
+        if (len == 0) {
+            break;
+        }
+        read = true;
+        for (uint32_t i = 0; i < len; i++) {
+            uart_put_char(buf[i]);
+        }
+    }
+    uart_tx_fill();
+
+    if (read && ring_buffer_notify_requested(ring)) {
+        microkit_notify(CLIENT_CH);
+    }
+}
+
+/*
+ * Drain the RX FIFO and hand everything to the client in one go. If the client
+ * is not keeping up and its ring is full, the extra input is dropped.
+ */
+static bool serial_rx_drain() {
+    struct ring_buffer *ring = (struct ring_buffer *)serial_to_client_vaddr;
+    char buf[64];
+    uint32_t len = 0;
+    bool received = false;
+    while ((*REG_PTR(uart_base_vaddr, UARTFR) & PL011_UARTFR_RXFE) == 0) {
+        buf[len++] = uart_get_char();
+        if (len == sizeof(buf)) {
+            ring_buffer_write(ring, buf, len);
+            len = 0;
+            received = true;
+        }
+    }
+    if (len != 0) {
+        ring_buffer_write(ring, buf, len);
+        received = true;
+    }
+
+    return received;
 }
 
 void init(void) {
@@ -70,22 +214,28 @@ void init(void) {
     uart_put_str("SERIAL SERVER: starting\n");
 }
 
-#define UART_IRQ_CH 1
-#define CLIENT_CH 2
-
-uintptr_t serial_to_client_vaddr;
-uintptr_t client_to_serial_vaddr;
-
 void notified(microkit_channel channel) {
     switch (channel) {
-        case UART_IRQ_CH:
-            ((char *)serial_to_client_vaddr)[0] = uart_get_char();
+        case UART_IRQ_CH: {
+            uint32_t status = *REG_PTR(uart_base_vaddr, UARTMIS);
+            bool received = false;
+            if (status & (PL011_INT_RX | PL011_INT_RT)) {
+                received = serial_rx_drain();
+            }
             uart_handle_irq();
+            if (status & PL011_INT_TX) {
+                serial_tx_pump();
+            }
             microkit_irq_ack(channel);
-            microkit_notify(CLIENT_CH);
+            if (received) {
+                microkit_notify(CLIENT_CH);
+            }
             break;
+        }
         case CLIENT_CH:
-            uart_put_str((char *)client_to_serial_vaddr);
+            // Drain everything the client has queued up since the last
+            // notification.
+            serial_tx_pump();
             break;
     }
 }
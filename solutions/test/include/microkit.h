@@ -0,0 +1,183 @@
+/*
+ * Copyright 2023, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Stand-in for the Microkit SDK's microkit.h for code that is built and run on
+ * the host by the tests. It only has what the code under test uses, anything
+ * that would be a system call is left for each test to implement.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef uint64_t seL4_Word;
+typedef uint8_t seL4_Uint8;
+typedef uint16_t seL4_Uint16;
+typedef seL4_Word seL4_CPtr;
+typedef int seL4_Bool;
+
+typedef enum {
+    seL4_NoError = 0,
+    seL4_InvalidArgument,
+    seL4_InvalidCapability,
+    seL4_IllegalOperation,
+    seL4_RangeError,
+    seL4_AlignmentError,
+    seL4_FailedLookup,
+    seL4_TruncatedMessage,
+    seL4_DeleteFirst,
+    seL4_RevokeFirst,
+    seL4_NotEnoughMemory,
+} seL4_Error;
+
+typedef unsigned int microkit_channel;
+typedef unsigned int microkit_child;
+
+typedef struct {
+    seL4_Word words[1];
+} microkit_msginfo;
+
+#define MICROKIT_MSGINFO_LABEL_SHIFT 12
+#define MICROKIT_MSGINFO_COUNT_MASK 0x7f
+
+static inline microkit_msginfo microkit_msginfo_new(seL4_Word label, seL4_Uint16 count)
+{
+    return (microkit_msginfo) { { (label << MICROKIT_MSGINFO_LABEL_SHIFT) | (count & MICROKIT_MSGINFO_COUNT_MASK) } };
+}
+
+static inline seL4_Word microkit_msginfo_get_label(microkit_msginfo msginfo)
+{
+    return msginfo.words[0] >> MICROKIT_MSGINFO_LABEL_SHIFT;
+}
+
+static inline seL4_Word microkit_msginfo_get_count(microkit_msginfo msginfo)
+{
+    return msginfo.words[0] & MICROKIT_MSGINFO_COUNT_MASK;
+}
+
+/* Only AArch64 is supported, as the VMM only supports AArch64 guests */
+#define CONFIG_ARCH_AARCH64 1
+#ifndef CONFIG_MAX_NUM_NODES
+#define CONFIG_MAX_NUM_NODES 1
+#endif
+
+#define BASE_VM_TCB_CAP 266
+#define BASE_VCPU_CAP 330
+
+typedef struct {
+    seL4_Word pc, sp, spsr, x0, x1, x2, x3, x4, x5, x6, x7, x8, x16, x17, x18, x29, x30,
+              x9, x10, x11, x12, x13, x14, x15, x19, x20, x21, x22, x23, x24, x25, x26, x27, x28,
+              tpidr_el0, tpidrro_el0;
+} seL4_UserContext;
+
+typedef enum {
+    seL4_Fault_NullFault,
+    seL4_Fault_CapFault,
+    seL4_Fault_UnknownSyscall,
+    seL4_Fault_UserException,
+    seL4_Fault_VMFault,
+    seL4_Fault_VGICMaintenance,
+    seL4_Fault_VCPUFault,
+    seL4_Fault_VPPIEvent,
+} seL4_FaultType;
+
+enum {
+    seL4_VMFault_IP,
+    seL4_VMFault_Addr,
+    seL4_VMFault_PrefetchFault,
+    seL4_VMFault_FSR,
+    seL4_VMFault_Length,
+};
+
+enum {
+    seL4_UnknownSyscall_X0,
+    seL4_UnknownSyscall_X1,
+    seL4_UnknownSyscall_X2,
+    seL4_UnknownSyscall_X3,
+    seL4_UnknownSyscall_X4,
+    seL4_UnknownSyscall_X5,
+    seL4_UnknownSyscall_X6,
+    seL4_UnknownSyscall_X7,
+    seL4_UnknownSyscall_FaultIP,
+    seL4_UnknownSyscall_SP,
+    seL4_UnknownSyscall_LR,
+    seL4_UnknownSyscall_SPSR,
+    seL4_UnknownSyscall_Syscall,
+    seL4_UnknownSyscall_Length,
+};
+
+enum {
+    seL4_UserException_FaultIP,
+    seL4_UserException_SP,
+    seL4_UserException_SPSR,
+    seL4_UserException_Number,
+    seL4_UserException_Code,
+    seL4_UserException_Length,
+};
+
+enum {
+    seL4_VGICMaintenance_IDX,
+    seL4_VGICMaintenance_Length,
+};
+
+enum {
+    seL4_VCPUReg_SCTLR,
+    seL4_VCPUReg_TTBR0,
+    seL4_VCPUReg_TTBR1,
+    seL4_VCPUReg_TCR,
+    seL4_VCPUReg_MAIR,
+    seL4_VCPUReg_AMAIR,
+    seL4_VCPUReg_CIDR,
+    seL4_VCPUReg_ACTLR,
+    seL4_VCPUReg_CPACR,
+    seL4_VCPUReg_AFSR0,
+    seL4_VCPUReg_AFSR1,
+    seL4_VCPUReg_ESR,
+    seL4_VCPUReg_FAR,
+    seL4_VCPUReg_ISR,
+    seL4_VCPUReg_VBAR,
+    seL4_VCPUReg_TPIDR_EL1,
+#if CONFIG_MAX_NUM_NODES > 1
+    seL4_VCPUReg_VMPIDR_EL2,
+#endif
+    seL4_VCPUReg_SP_EL1,
+    seL4_VCPUReg_ELR_EL1,
+    seL4_VCPUReg_SPSR_EL1,
+    seL4_VCPUReg_CNTV_CTL,
+    seL4_VCPUReg_CNTV_CVAL,
+    seL4_VCPUReg_CNTVOFF,
+    seL4_VCPUReg_CNTKCTL_EL1,
+    seL4_VCPUReg_Num,
+};
+
+extern char microkit_name[16];
+
+void microkit_dbg_putc(int c);
+void microkit_dbg_puts(const char *s);
+void microkit_notify(microkit_channel ch);
+void microkit_irq_ack(microkit_channel ch);
+microkit_msginfo microkit_ppcall(microkit_channel ch, microkit_msginfo msginfo);
+void microkit_mr_set(seL4_Uint8 mr, seL4_Word value);
+seL4_Word microkit_mr_get(seL4_Uint8 mr);
+
+void microkit_vcpu_restart(microkit_child vcpu, seL4_Word entry_point);
+void microkit_vcpu_stop(microkit_child vcpu);
+void microkit_vcpu_arm_inject_irq(microkit_child vcpu, seL4_Uint16 irq, seL4_Uint8 priority,
+                                  seL4_Uint8 group, seL4_Uint8 index);
+void microkit_vcpu_arm_ack_vppi(microkit_child vcpu, seL4_Word irq);
+seL4_Word microkit_vcpu_arm_read_reg(microkit_child vcpu, seL4_Word reg);
+void microkit_vcpu_arm_write_reg(microkit_child vcpu, seL4_Word reg, seL4_Word value);
+
+seL4_Word seL4_GetMR(int i);
+void seL4_Send(seL4_CPtr dest, microkit_msginfo msginfo);
+seL4_Error seL4_TCB_ReadRegisters(seL4_CPtr tcb, seL4_Bool suspend_source, seL4_Uint8 arch_flags,
+                                  seL4_Word count, seL4_UserContext *regs);
+seL4_Error seL4_TCB_WriteRegisters(seL4_CPtr tcb, seL4_Bool resume_target, seL4_Uint8 arch_flags,
+                                   seL4_Word count, seL4_UserContext *regs);
+seL4_Error seL4_ARM_VCPU_InjectIRQ(seL4_CPtr vcpu, seL4_Uint16 virq, seL4_Uint8 priority,
+                                   seL4_Uint8 group, seL4_Uint8 index);
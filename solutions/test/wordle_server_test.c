@@ -0,0 +1,243 @@
+/*
+ * Copyright 2023, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Tests the Wordle server's scoring of guesses, and times scoring every word
+ * in the dictionary against every other word.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <microkit.h>
+#include "wordle.h"
+#include "dictionary.h"
+
+/* From wordle_server.c */
+extern char word[WORD_LENGTH];
+void word_update_letter_count();
+void score_guess(char *guess, enum character_state *states);
+bool is_word_in_dictionary(uint32_t packed);
+
+#define NUM_DICTIONARY_WORDS (sizeof(dictionary) / sizeof(dictionary[0]))
+
+/* How many secret words the reference scorer is checked against */
+#define NUM_REFERENCE_WORDS 1000
+
+char microkit_name[16] = "test";
+
+void microkit_dbg_puts(const char *s)
+{
+    fputs(s, stdout);
+}
+
+static seL4_Word mrs[4];
+
+void microkit_mr_set(seL4_Uint8 mr, seL4_Word value)
+{
+    mrs[mr] = value;
+}
+
+seL4_Word microkit_mr_get(seL4_Uint8 mr)
+{
+    return mrs[mr];
+}
+
+static void set_word(const char *secret)
+{
+    for (int i = 0; i < WORD_LENGTH; i++) {
+        word[i] = secret[i];
+    }
+    word_update_letter_count();
+}
+
+/* G for the right letter in the right place, Y for the wrong place, - for neither */
+static void states_to_string(const enum character_state *states, char *str)
+{
+    for (int i = 0; i < WORD_LENGTH; i++) {
+        switch (states[i]) {
+        case CORRECT_PLACEMENT: str[i] = 'G'; break;
+        case INCORRECT_PLACEMENT: str[i] = 'Y'; break;
+        case INCORRECT: str[i] = '-'; break;
+        }
+    }
+    str[WORD_LENGTH] = '\0';
+}
+
+/*
+ * The rules written out as plainly as possible: a letter of the word can only
+ * be used once, by a character in the right place if there is one, otherwise
+ * by the first character in the wrong place.
+ */
+static void reference_score(const char *secret, const char *guess, enum character_state *states)
+{
+    bool used[WORD_LENGTH] = { false };
+    for (int i = 0; i < WORD_LENGTH; i++) {
+        states[i] = INCORRECT;
+        if (guess[i] == secret[i]) {
+            states[i] = CORRECT_PLACEMENT;
+            used[i] = true;
+        }
+    }
+    for (int i = 0; i < WORD_LENGTH; i++) {
+        if (states[i] == CORRECT_PLACEMENT) {
+            continue;
+        }
+        for (int j = 0; j < WORD_LENGTH; j++) {
+            if (!used[j] && guess[i] == secret[j]) {
+                states[i] = INCORRECT_PLACEMENT;
+                used[j] = true;
+                break;
+            }
+        }
+    }
+}
+
+struct score_case {
+    const char *secret;
+    const char *guess;
+    const char *expected;
+};
+
+static const struct score_case score_cases[] = {
+    { "hello", "hello", "GGGGG" },
+    { "hello", "HELLO", "GGGGG" },
+    { "hello", "olleh", "YYGYY" },
+    /* Both l's of the word are used up by the correct ones */
+    { "hello", "lllll", "--GG-" },
+    /* Only two l's in the word to be yellow */
+    { "hello", "llama", "YY---" },
+    /* The correct l uses up one of the two, leaving one for the first wrong one */
+    { "hello", "lolol", "YYG--" },
+    /* The correct b's come first even though the yellow one is earlier */
+    { "abbey", "bobby", "Y-G-G" },
+    { "aaaaa", "abcde", "G----" },
+    { "abcde", "fghij", "-----" },
+};
+
+static bool test_score_cases(void)
+{
+    bool passed = true;
+    for (int i = 0; i < sizeof(score_cases) / sizeof(score_cases[0]); i++) {
+        const struct score_case *c = &score_cases[i];
+        char guess[WORD_LENGTH];
+        enum character_state states[WORD_LENGTH];
+        char result[WORD_LENGTH + 1];
+        for (int j = 0; j < WORD_LENGTH; j++) {
+            guess[j] = c->guess[j];
+        }
+        set_word(c->secret);
+        score_guess(guess, states);
+        states_to_string(states, result);
+        for (int j = 0; j <= WORD_LENGTH; j++) {
+            if (result[j] != c->expected[j]) {
+                printf("FAIL: %s against %s gave %s, expected %s\n", c->guess, c->secret, result, c->expected);
+                passed = false;
+                break;
+            }
+        }
+    }
+
+    return passed;
+}
+
+/* Check against the reference for every guess and a good number of secret words */
+static bool test_reference(void)
+{
+    int num_words = NUM_DICTIONARY_WORDS < NUM_REFERENCE_WORDS ? NUM_DICTIONARY_WORDS : NUM_REFERENCE_WORDS;
+    for (int i = 0; i < num_words; i++) {
+        char secret[WORD_LENGTH];
+        wordle_unpack_word(dictionary[i], secret);
+        set_word(secret);
+        for (int j = 0; j < NUM_DICTIONARY_WORDS; j++) {
+            char guess[WORD_LENGTH];
+            enum character_state states[WORD_LENGTH];
+            enum character_state expected[WORD_LENGTH];
+            wordle_unpack_word(dictionary[j], guess);
+            score_guess(guess, states);
+            reference_score(secret, guess, expected);
+            for (int k = 0; k < WORD_LENGTH; k++) {
+                if (states[k] != expected[k]) {
+                    char result[WORD_LENGTH + 1], expected_result[WORD_LENGTH + 1];
+                    states_to_string(states, result);
+                    states_to_string(expected, expected_result);
+                    printf("FAIL: %.5s against %.5s gave %s, expected %s\n", guess, secret, result, expected_result);
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool test_dictionary(void)
+{
+    bool passed = true;
+    for (int i = 0; i < NUM_DICTIONARY_WORDS; i++) {
+        if (!is_word_in_dictionary(dictionary[i])) {
+            char w[WORD_LENGTH];
+            wordle_unpack_word(dictionary[i], w);
+            printf("FAIL: %.5s is not found in the dictionary\n", w);
+            passed = false;
+        }
+    }
+    if (is_word_in_dictionary(wordle_pack_word("qzxjv"))) {
+        printf("FAIL: qzxjv is found in the dictionary\n");
+        passed = false;
+    }
+
+    return passed;
+}
+
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Score every word in the dictionary against every other word. */
+static void bench_score_all(void)
+{
+    /* Unpack the words up front so that only scoring is timed */
+    char (*words)[WORD_LENGTH] = malloc(NUM_DICTIONARY_WORDS * WORD_LENGTH);
+    for (int i = 0; i < NUM_DICTIONARY_WORDS; i++) {
+        wordle_unpack_word(dictionary[i], words[i]);
+    }
+
+    /* Keeps the compiler from throwing the scoring away */
+    uint64_t correct = 0;
+    uint64_t start = time_ns();
+    for (int i = 0; i < NUM_DICTIONARY_WORDS; i++) {
+        set_word(words[i]);
+        for (int j = 0; j < NUM_DICTIONARY_WORDS; j++) {
+            enum character_state states[WORD_LENGTH];
+            score_guess(words[j], states);
+            correct += (states[0] == CORRECT_PLACEMENT);
+        }
+    }
+    uint64_t elapsed = time_ns() - start;
+
+    uint64_t guesses = (uint64_t)NUM_DICTIONARY_WORDS * NUM_DICTIONARY_WORDS;
+    printf("BENCH: scored %lu guesses in %lu ms, %.1f ns per guess (%lu first letters correct)\n",
+           guesses, elapsed / 1000000, (double)elapsed / guesses, correct);
+    free(words);
+}
+
+int main(void)
+{
+    bool passed = test_score_cases();
+    passed = test_reference() && passed;
+    passed = test_dictionary() && passed;
+    if (!passed) {
+        return 1;
+    }
+    printf("PASS: wordle_server\n");
+    bench_score_all();
+
+    return 0;
+}
@@ -18,16 +18,212 @@
 //     return !CPSR_IS_THUMB(regs->spsr);
 // }
 
-bool fault_advance_vcpu(seL4_UserContext *regs) {
-    // For now we just ignore it and continue
-    // Assume 64-bit instruction
-    regs->pc += 4;
-    int err = seL4_TCB_WriteRegisters(BASE_VM_TCB_CAP + GUEST_ID, true, 0, SEL4_USER_CONTEXT_SIZE, regs);
+static struct fault_ctx fault_ctxs[GUEST_NUM_VCPUS];
+static struct fault_stats fault_stats;
+
+static_assert(sizeof(seL4_UserContext) == FAULT_REG_NUM * sizeof(seL4_Word),
+              "fault_reg does not match seL4_UserContext");
+static_assert(FAULT_REG_NUM == SEL4_USER_CONTEXT_SIZE,
+              "fault_reg does not match SEL4_USER_CONTEXT_SIZE");
+
+/*
+ * For some faults, the kernel sends us some of the registers of the faulting
+ * thread in the fault message, and copies them back from our reply. These
+ * tables say which register is in which message register, -1 is for message
+ * registers we just hand back as they were.
+ */
+static const int unknown_syscall_msg_regs[] = {
+    [seL4_UnknownSyscall_X0] = FAULT_REG_X0,
+    [seL4_UnknownSyscall_X1] = FAULT_REG_X1,
+    [seL4_UnknownSyscall_X2] = FAULT_REG_X2,
+    [seL4_UnknownSyscall_X3] = FAULT_REG_X3,
+    [seL4_UnknownSyscall_X4] = FAULT_REG_X4,
+    [seL4_UnknownSyscall_X5] = FAULT_REG_X5,
+    [seL4_UnknownSyscall_X6] = FAULT_REG_X6,
+    [seL4_UnknownSyscall_X7] = FAULT_REG_X7,
+    [seL4_UnknownSyscall_FaultIP] = FAULT_REG_PC,
+    [seL4_UnknownSyscall_SP] = FAULT_REG_SP,
+    [seL4_UnknownSyscall_LR] = -1,
+    [seL4_UnknownSyscall_SPSR] = FAULT_REG_SPSR,
+};
+
+static const int user_exception_msg_regs[] = {
+    [seL4_UserException_FaultIP] = FAULT_REG_PC,
+    [seL4_UserException_SP] = FAULT_REG_SP,
+    [seL4_UserException_SPSR] = FAULT_REG_SPSR,
+};
+
+static_assert(ARRAY_SIZE(unknown_syscall_msg_regs) <= FAULT_MAX_MSG_REGS, "FAULT_MAX_MSG_REGS too small");
+static_assert(ARRAY_SIZE(user_exception_msg_regs) <= FAULT_MAX_MSG_REGS, "FAULT_MAX_MSG_REGS too small");
+
+struct fault_ctx *fault_ctx_begin(uint64_t vcpu_id, uint64_t label)
+{
+    assert(vcpu_id < GUEST_NUM_VCPUS);
+    struct fault_ctx *ctx = &fault_ctxs[vcpu_id];
+    ctx->vcpu_id = vcpu_id;
+    ctx->valid = 0;
+    ctx->dirty = 0;
+    ctx->msg_regs = NULL;
+    ctx->num_msg_regs = 0;
+    ctx->reply_regs = 0;
+    ctx->used = false;
+    ctx->transferred = 0;
+    fault_stats.faults++;
+
+    switch (label) {
+        case seL4_Fault_UnknownSyscall:
+            ctx->msg_regs = unknown_syscall_msg_regs;
+            ctx->num_msg_regs = ARRAY_SIZE(unknown_syscall_msg_regs);
+            break;
+        case seL4_Fault_UserException:
+            ctx->msg_regs = user_exception_msg_regs;
+            ctx->num_msg_regs = ARRAY_SIZE(user_exception_msg_regs);
+            break;
+    }
+    /*
+     * Take what we can from the fault message now, the handler might use the
+     * message registers for something else (e.g a PPC) before we reply.
+     */
+    for (uint64_t i = 0; i < ctx->num_msg_regs; i++) {
+        ctx->msg[i] = microkit_mr_get(i);
+        int reg = ctx->msg_regs[i];
+        if (reg >= 0) {
+            ((seL4_Word *)&ctx->regs)[reg] = ctx->msg[i];
+            ctx->valid |= (1ULL << reg);
+            ctx->reply_regs |= (1ULL << reg);
+        }
+    }
+
+    return ctx;
+}
+
+/*
+ * Make sure the first `count` registers are valid. Registers that we already
+ * have are not touched, which matters since they may have been modified.
+ */
+static void fault_ctx_read(struct fault_ctx *ctx, uint64_t count)
+{
+    uint64_t wanted = (count == 64) ? ~0ULL : (1ULL << count) - 1;
+    if ((ctx->valid & wanted) == wanted) {
+        return;
+    }
+
+    seL4_UserContext regs;
+    int err = seL4_TCB_ReadRegisters(BASE_VM_TCB_CAP + ctx->vcpu_id, false, 0, count, &regs);
     assert(err == seL4_NoError);
 
+    seL4_Word *src = (seL4_Word *)&regs;
+    seL4_Word *dst = (seL4_Word *)&ctx->regs;
+    for (uint64_t i = 0; i < count; i++) {
+        if (!(ctx->valid & (1ULL << i))) {
+            dst[i] = src[i];
+        }
+    }
+    fault_stats.reads++;
+    fault_stats.regs_read += count;
+    ctx->transferred += count;
+    ctx->valid |= wanted;
+}
+
+uint64_t fault_ctx_get_reg(struct fault_ctx *ctx, enum fault_reg reg)
+{
+    assert(reg < FAULT_REG_NUM);
+    ctx->used = true;
+    fault_ctx_read(ctx, reg + 1);
+
+    return ((seL4_Word *)&ctx->regs)[reg];
+}
+
+void fault_ctx_set_reg(struct fault_ctx *ctx, enum fault_reg reg, uint64_t val)
+{
+    assert(reg < FAULT_REG_NUM);
+    ctx->used = true;
+    ((seL4_Word *)&ctx->regs)[reg] = val;
+    ctx->valid |= (1ULL << reg);
+    ctx->dirty |= (1ULL << reg);
+}
+
+seL4_UserContext *fault_ctx_regs(struct fault_ctx *ctx)
+{
+    ctx->used = true;
+    fault_ctx_read(ctx, SEL4_USER_CONTEXT_SIZE);
+
+    return &ctx->regs;
+}
+
+/*
+ * Get the registers that have been modified while handling the fault back to
+ * the vCPU, this is called once at the end of every fault we handle and fills
+ * in the reply to the fault.
+ *
+ * Where the kernel copies registers back from the reply (unknown syscall and
+ * user exception faults), modified registers go in the reply and do not cost
+ * anything extra. The reply to a VM fault or vCPU fault carries no registers,
+ * so for those, and for registers the reply can not hold, we still need one
+ * seL4_TCB_WriteRegisters call. It only writes the prefix of seL4_UserContext
+ * up to the last modified register: for an emulated MMIO write that is just
+ * the PC, for a read the PC through to the destination register.
+ *
+ * The vCPU is not resumed by writing its registers, that happens when we reply
+ * to the fault. This means that if the vCPU has been stopped while handling the
+ * fault, it stays stopped.
+ */
+bool fault_ctx_commit(struct fault_ctx *ctx, microkit_msginfo *reply_msginfo)
+{
+    int err = seL4_NoError;
+    /* What this fault would have cost when we read and wrote everything */
+    int64_t full = 0;
+    if (ctx->used) {
+        full += SEL4_USER_CONTEXT_SIZE;
+    }
+    if (ctx->dirty != 0) {
+        full += SEL4_USER_CONTEXT_SIZE;
+    }
+
+    uint64_t write_regs = ctx->dirty & ~ctx->reply_regs;
+    if (write_regs != 0) {
+        uint64_t count = 64 - __builtin_clzll(write_regs);
+        /* Everything before the last modified register goes along with it */
+        fault_ctx_read(ctx, count);
+        err = seL4_TCB_WriteRegisters(BASE_VM_TCB_CAP + ctx->vcpu_id, false, 0, count, &ctx->regs);
+        assert(err == seL4_NoError);
+        fault_stats.writes++;
+        fault_stats.regs_written += count;
+        ctx->transferred += count;
+    }
+
+    if (ctx->dirty & ctx->reply_regs) {
+        for (uint64_t i = 0; i < ctx->num_msg_regs; i++) {
+            int reg = ctx->msg_regs[i];
+            microkit_mr_set(i, reg >= 0 ? ((seL4_Word *)&ctx->regs)[reg] : ctx->msg[i]);
+        }
+        fault_stats.replies++;
+        *reply_msginfo = microkit_msginfo_new(0, ctx->num_msg_regs);
+    } else {
+        *reply_msginfo = microkit_msginfo_new(0, 0);
+    }
+    ctx->dirty = 0;
+    fault_stats.regs_saved += full - (int64_t)ctx->transferred;
+
     return (err == seL4_NoError);
 }
 
+void fault_print_stats(void)
+{
+    LOG_VMM("faults: %lu, register reads: %lu (%lu registers), register writes: %lu (%lu registers), "
+            "writes folded into replies: %lu, registers saved: %ld\n",
+            fault_stats.faults, fault_stats.reads, fault_stats.regs_read, fault_stats.writes,
+            fault_stats.regs_written, fault_stats.replies, fault_stats.regs_saved);
+}
+
+bool fault_advance_vcpu(struct fault_ctx *ctx) {
+    // For now we just ignore it and continue
+    // Assume 64-bit instruction
+    fault_ctx_set_reg(ctx, FAULT_REG_PC, fault_ctx_get_reg(ctx, FAULT_REG_PC) + 4);
+
+    return true;
+}
+
 char *fault_to_string(seL4_Word fault_label) {
     switch (fault_label) {
         case seL4_Fault_VMFault: return "virtual memory";
@@ -100,46 +296,46 @@ uint64_t fault_get_data_mask(uint64_t addr, uint64_t fsr)
     return mask;
 }
 
-static uint64_t wzr = 0;
-uint64_t *decode_rt(uint64_t reg, seL4_UserContext *regs)
+/* Returns -1 for the zero register, which has no entry in seL4_UserContext. */
+static int decode_rt(uint64_t reg)
 {
     switch (reg) {
-        case 0: return &regs->x0;
-        case 1: return &regs->x1;
-        case 2: return &regs->x2;
-        case 3: return &regs->x3;
-        case 4: return &regs->x4;
-        case 5: return &regs->x5;
-        case 6: return &regs->x6;
-        case 7: return &regs->x7;
-        case 8: return &regs->x8;
-        case 9: return &regs->x9;
-        case 10: return &regs->x10;
-        case 11: return &regs->x11;
-        case 12: return &regs->x12;
-        case 13: return &regs->x13;
-        case 14: return &regs->x14;
-        case 15: return &regs->x15;
-        case 16: return &regs->x16;
-        case 17: return &regs->x17;
-        case 18: return &regs->x18;
-        case 19: return &regs->x19;
-        case 20: return &regs->x20;
-        case 21: return &regs->x21;
-        case 22: return &regs->x22;
-        case 23: return &regs->x23;
-        case 24: return &regs->x24;
-        case 25: return &regs->x25;
-        case 26: return &regs->x26;
-        case 27: return &regs->x27;
-        case 28: return &regs->x28;
-        case 29: return &regs->x29;
-        case 30: return &regs->x30;
-        case 31: return &wzr;
+        case 0: return FAULT_REG_X0;
+        case 1: return FAULT_REG_X1;
+        case 2: return FAULT_REG_X2;
+        case 3: return FAULT_REG_X3;
+        case 4: return FAULT_REG_X4;
+        case 5: return FAULT_REG_X5;
+        case 6: return FAULT_REG_X6;
+        case 7: return FAULT_REG_X7;
+        case 8: return FAULT_REG_X8;
+        case 9: return FAULT_REG_X9;
+        case 10: return FAULT_REG_X10;
+        case 11: return FAULT_REG_X11;
+        case 12: return FAULT_REG_X12;
+        case 13: return FAULT_REG_X13;
+        case 14: return FAULT_REG_X14;
+        case 15: return FAULT_REG_X15;
+        case 16: return FAULT_REG_X16;
+        case 17: return FAULT_REG_X17;
+        case 18: return FAULT_REG_X18;
+        case 19: return FAULT_REG_X19;
+        case 20: return FAULT_REG_X20;
+        case 21: return FAULT_REG_X21;
+        case 22: return FAULT_REG_X22;
+        case 23: return FAULT_REG_X23;
+        case 24: return FAULT_REG_X24;
+        case 25: return FAULT_REG_X25;
+        case 26: return FAULT_REG_X26;
+        case 27: return FAULT_REG_X27;
+        case 28: return FAULT_REG_X28;
+        case 29: return FAULT_REG_X29;
+        case 30: return FAULT_REG_X30;
+        case 31: return -1;
         default:
             printf("invalid reg %d\n", reg);
             assert(!"Invalid register");
-            return NULL;
+            return -1;
     }
 }
 
@@ -169,17 +365,19 @@ static int get_rt(uint64_t fsr)
     return rt;
 }
 
-uint64_t fault_get_data(seL4_UserContext *regs, uint64_t fsr)
+uint64_t fault_get_data(struct fault_ctx *ctx, uint64_t fsr)
 {
     /* Get register opearand */
-    int rt  = get_rt(fsr);
-
-    uint64_t data = *decode_rt(rt, regs);
+    int reg = decode_rt(get_rt(fsr));
+    if (reg < 0) {
+        /* The zero register */
+        return 0;
+    }
 
-    return data;
+    return fault_ctx_get_reg(ctx, reg);
 }
 
-uint64_t fault_emulate(seL4_UserContext *regs, uint64_t reg, uint64_t addr, uint64_t fsr, uint64_t reg_val)
+uint64_t fault_emulate(struct fault_ctx *ctx, uint64_t reg, uint64_t addr, uint64_t fsr, uint64_t reg_val)
 {
     uint64_t m, s;
     s = (addr & 0x3) * 8;
@@ -193,15 +391,17 @@ uint64_t fault_emulate(seL4_UserContext *regs, uint64_t reg, uint64_t addr, uint
     }
 }
 
-bool fault_advance(seL4_UserContext *regs, uint64_t addr, uint64_t fsr, uint64_t reg_val)
+bool fault_advance(struct fault_ctx *ctx, uint64_t addr, uint64_t fsr, uint64_t reg_val)
 {
     /* Get register opearand */
-    int rt = get_rt(fsr);
-
-    uint64_t *reg_ctx = decode_rt(rt, regs);
-    *reg_ctx = fault_emulate(regs, *reg_ctx, addr, fsr, reg_val);
+    int reg = decode_rt(get_rt(fsr));
+    if (reg >= 0) {
+        /* Reads into the zero register are discarded */
+        uint64_t old = fault_ctx_get_reg(ctx, reg);
+        fault_ctx_set_reg(ctx, reg, fault_emulate(ctx, old, addr, fsr, reg_val));
+    }
     // DFAULT("%s: Emulate fault @ 0x%x from PC 0x%x\n",
     //        fault->vcpu->vm->vm_name, fault->addr, fault->ip);
 
-    return fault_advance_vcpu(regs);
+    return fault_advance_vcpu(ctx);
 }
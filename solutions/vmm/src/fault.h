@@ -4,15 +4,118 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#pragma once
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <microkit.h>
 
-bool fault_advance_vcpu(seL4_UserContext *regs);
-bool fault_advance(seL4_UserContext *regs, uint64_t addr, uint64_t fsr, uint64_t reg_val);
+/*
+ * Indices of the registers in seL4_UserContext. seL4_TCB_ReadRegisters and
+ * seL4_TCB_WriteRegisters only transfer the first `count` registers of
+ * seL4_UserContext, so this order is what decides how much we have to read or
+ * write to get at a particular register.
+ */
+enum fault_reg {
+    FAULT_REG_PC = 0,
+    FAULT_REG_SP,
+    FAULT_REG_SPSR,
+    FAULT_REG_X0,
+    FAULT_REG_X1,
+    FAULT_REG_X2,
+    FAULT_REG_X3,
+    FAULT_REG_X4,
+    FAULT_REG_X5,
+    FAULT_REG_X6,
+    FAULT_REG_X7,
+    FAULT_REG_X8,
+    FAULT_REG_X16,
+    FAULT_REG_X17,
+    FAULT_REG_X18,
+    FAULT_REG_X29,
+    FAULT_REG_X30,
+    FAULT_REG_X9,
+    FAULT_REG_X10,
+    FAULT_REG_X11,
+    FAULT_REG_X12,
+    FAULT_REG_X13,
+    FAULT_REG_X14,
+    FAULT_REG_X15,
+    FAULT_REG_X19,
+    FAULT_REG_X20,
+    FAULT_REG_X21,
+    FAULT_REG_X22,
+    FAULT_REG_X23,
+    FAULT_REG_X24,
+    FAULT_REG_X25,
+    FAULT_REG_X26,
+    FAULT_REG_X27,
+    FAULT_REG_X28,
+    FAULT_REG_TPIDR_EL0,
+    FAULT_REG_TPIDRRO_EL0,
+    FAULT_REG_NUM,
+};
+
+/* The most message registers of a fault message that hold registers. */
+#define FAULT_MAX_MSG_REGS 12
+
+/*
+ * The registers of a vCPU while we are handling one of its faults. Registers
+ * are only read from the TCB once something asks for them, and only the ones
+ * that have been modified get written back, once, when the fault has been
+ * handled (see fault_ctx_commit).
+ */
+struct fault_ctx {
+    uint64_t vcpu_id;
+    seL4_UserContext regs;
+    /* Bitmap of the registers in regs that hold the vCPU's values, indexed by fault_reg */
+    uint64_t valid;
+    /* Bitmap of the registers that have been modified */
+    uint64_t dirty;
+    /*
+     * The fault message, for faults where the kernel gives us registers in
+     * it and copies them back from the reply. msg_regs maps each message
+     * register to a fault_reg, reply_regs is the registers that are in it.
+     */
+    const int *msg_regs;
+    uint64_t num_msg_regs;
+    seL4_Word msg[FAULT_MAX_MSG_REGS];
+    uint64_t reply_regs;
+    /* Whether the handler looked at the registers at all */
+    bool used;
+    /* How many registers we have read and written for this fault */
+    uint64_t transferred;
+};
+
+/* Counters to see how much the lazy reading and writing is saving us. */
+struct fault_stats {
+    uint64_t faults;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t regs_read;
+    uint64_t regs_written;
+    /* Faults where the modified registers went back in the reply */
+    uint64_t replies;
+    /*
+     * Compared to reading all registers whenever a fault needs any of them,
+     * and writing all of them whenever it modifies any.
+     */
+    int64_t regs_saved;
+};
+
+struct fault_ctx *fault_ctx_begin(uint64_t vcpu_id, uint64_t label);
+uint64_t fault_ctx_get_reg(struct fault_ctx *ctx, enum fault_reg reg);
+void fault_ctx_set_reg(struct fault_ctx *ctx, enum fault_reg reg, uint64_t val);
+/* Read all the registers, for when we need the whole context (e.g to print it). */
+seL4_UserContext *fault_ctx_regs(struct fault_ctx *ctx);
+bool fault_ctx_commit(struct fault_ctx *ctx, microkit_msginfo *reply_msginfo);
+void fault_print_stats(void);
+
+bool fault_advance_vcpu(struct fault_ctx *ctx);
+bool fault_advance(struct fault_ctx *ctx, uint64_t addr, uint64_t fsr, uint64_t reg_val);
 uint64_t fault_get_data_mask(uint64_t addr, uint64_t fsr);
-uint64_t fault_get_data(seL4_UserContext *regs, uint64_t fsr);
-uint64_t fault_emulate(seL4_UserContext *regs, uint64_t reg, uint64_t addr, uint64_t fsr, uint64_t reg_val);
+uint64_t fault_get_data(struct fault_ctx *ctx, uint64_t fsr);
+uint64_t fault_emulate(struct fault_ctx *ctx, uint64_t reg, uint64_t addr, uint64_t fsr, uint64_t reg_val);
 
 /* Take the fault label given by the kernel and convert it to a string. */
 char *fault_to_string(seL4_Word fault_label);
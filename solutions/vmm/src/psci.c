@@ -12,7 +12,7 @@
 #include "util/util.h"
 #include "vmm.h"
 
-bool handle_psci(uint64_t vcpu_id, seL4_UserContext *regs, uint64_t fn_number, uint32_t hsr)
+bool handle_psci(uint64_t vcpu_id, struct fault_ctx *ctx, uint64_t fn_number, uint32_t hsr)
 {
     // @ivanv: write a note about what convention we assume, should we be checking
     // the convention?
@@ -20,21 +20,45 @@ bool handle_psci(uint64_t vcpu_id, seL4_UserContext *regs, uint64_t fn_number, u
         case PSCI_VERSION: {
             /* We support PSCI version 1.2 */
             uint32_t version = PSCI_MAJOR_VERSION(1) | PSCI_MINOR_VERSION(2);
-            smc_set_return_value(regs, version);
+            smc_set_return_value(ctx, version);
             break;
         }
         case PSCI_CPU_ON: {
-            uintptr_t target_cpu = smc_get_arg(regs, 1);
-            // Right now we only have one vCPU and so any fault for a target vCPU
-            // that isn't the one that's already on we consider an error on the
-            // guest's side.
-            // @ivanv: adapt for starting other vCPUs
-            if (target_cpu == vcpu_id) {
-                smc_set_return_value(regs, PSCI_ALREADY_ON);
-            } else {
+            /* The target is given by its MPIDR, the vCPU ID is the lowest affinity level */
+            uintptr_t target_cpu = smc_get_arg(ctx, 1);
+            uintptr_t entry_point = smc_get_arg(ctx, 2);
+            uint64_t context_id = smc_get_arg(ctx, 3);
+            if (target_cpu >= GUEST_NUM_VCPUS) {
                 // The guest has requested to turn on a virtual CPU that does
                 // not exist.
-                smc_set_return_value(regs, PSCI_INVALID_PARAMETERS);
+                smc_set_return_value(ctx, PSCI_INVALID_PARAMETERS);
+            } else if (guest_vcpu_is_on(target_cpu)) {
+                smc_set_return_value(ctx, PSCI_ALREADY_ON);
+            } else if (guest_vcpu_start(target_cpu, entry_point, context_id)) {
+                LOG_VMM("vCPU %d turned on vCPU %d at 0x%lx\n", vcpu_id, target_cpu, entry_point);
+                smc_set_return_value(ctx, PSCI_SUCCESS);
+            } else {
+                smc_set_return_value(ctx, PSCI_INTERNAL_FAILURE);
+            }
+            break;
+        }
+        case PSCI_CPU_OFF:
+            /*
+             * CPU_OFF does not return when it succeeds. The vCPU stays
+             * stopped until it is turned on again with CPU_ON, which gives it
+             * a new entry point, so there is no point advancing the PC.
+             */
+            guest_vcpu_stop(vcpu_id);
+            return true;
+        case PSCI_AFFINTY_INFO: {
+            /* We only know about the lowest affinity level, which is all Linux asks about */
+            uintptr_t target_cpu = smc_get_arg(ctx, 1);
+            uint64_t lowest_affinity_level = smc_get_arg(ctx, 2);
+            if (target_cpu >= GUEST_NUM_VCPUS || lowest_affinity_level != 0) {
+                smc_set_return_value(ctx, PSCI_INVALID_PARAMETERS);
+            } else {
+                /* 0 is ON, 1 is OFF */
+                smc_set_return_value(ctx, guest_vcpu_is_on(target_cpu) ? 0 : 1);
             }
             break;
         }
@@ -45,17 +69,17 @@ bool handle_psci(uint64_t vcpu_id, seL4_UserContext *regs, uint64_t fn_number, u
              * system that does not use a "Trusted OS" as the PSCI
              * specification says.
              */
-            smc_set_return_value(regs, 2);
+            smc_set_return_value(ctx, 2);
             break;
         case PSCI_FEATURES:
             // @ivanv: seems weird that we just return nothing here.
-            smc_set_return_value(regs, PSCI_NOT_SUPPORTED);
+            smc_set_return_value(ctx, PSCI_NOT_SUPPORTED);
             break;
         case PSCI_SYSTEM_RESET: {
             bool success = guest_restart();
             if (!success) {
                 LOG_VMM_ERR("Failed to restart guest\n");
-                smc_set_return_value(regs, PSCI_INTERNAL_FAILURE);
+                smc_set_return_value(ctx, PSCI_INTERNAL_FAILURE);
             } else {
                 /*
                  * If we've successfully restarted the guest, all we want to do
@@ -77,7 +101,7 @@ bool handle_psci(uint64_t vcpu_id, seL4_UserContext *regs, uint64_t fn_number, u
             return false;
     }
 
-    bool success = fault_advance_vcpu(regs);
+    bool success = fault_advance_vcpu(ctx);
     assert(success);
 
     return success;
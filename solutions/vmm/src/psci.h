@@ -7,6 +7,7 @@
 
 #include <microkit.h>
 #include <stdint.h>
+#include "fault.h"
 
 /* Values in this file are taken from the:
  * ARM Power State Coordination Interface
@@ -60,4 +61,4 @@ typedef enum psci {
     PSCI_MAX = 0x1f
 } psci_id_t;
 
-bool handle_psci(uint64_t vcpu_id, seL4_UserContext *regs,  uint64_t fn_number, uint32_t hsr);
+bool handle_psci(uint64_t vcpu_id, struct fault_ctx *ctx,  uint64_t fn_number, uint32_t hsr);
@@ -50,25 +50,25 @@ static smc_call_id_t smc_get_call(uintptr_t func_id)
     }
 }
 
-static inline uint64_t smc_get_function_number(seL4_UserContext *regs)
+static inline uint64_t smc_get_function_number(struct fault_ctx *ctx)
 {
-    return regs->x0 & SMC_FUNC_ID_MASK;
+    return fault_ctx_get_reg(ctx, FAULT_REG_X0) & SMC_FUNC_ID_MASK;
 }
 
-inline void smc_set_return_value(seL4_UserContext *u, uint64_t val)
+inline void smc_set_return_value(struct fault_ctx *ctx, uint64_t val)
 {
-    u->x0 = val;
+    fault_ctx_set_reg(ctx, FAULT_REG_X0, val);
 }
 
-uint64_t smc_get_arg(seL4_UserContext *u, uint64_t arg)
+uint64_t smc_get_arg(struct fault_ctx *ctx, uint64_t arg)
 {
     switch (arg) {
-        case 1: return u->x1;
-        case 2: return u->x2;
-        case 3: return u->x3;
-        case 4: return u->x4;
-        case 5: return u->x5;
-        case 6: return u->x6;
+        case 1: return fault_ctx_get_reg(ctx, FAULT_REG_X1);
+        case 2: return fault_ctx_get_reg(ctx, FAULT_REG_X2);
+        case 3: return fault_ctx_get_reg(ctx, FAULT_REG_X3);
+        case 4: return fault_ctx_get_reg(ctx, FAULT_REG_X4);
+        case 5: return fault_ctx_get_reg(ctx, FAULT_REG_X5);
+        case 6: return fault_ctx_get_reg(ctx, FAULT_REG_X6);
         default:
             LOG_VMM_ERR("trying to get SMC arg: 0x%lx, SMC only has 6 argument registers\n", arg);
             // @ivanv: come back to this
@@ -76,36 +76,30 @@ uint64_t smc_get_arg(seL4_UserContext *u, uint64_t arg)
     }
 }
 
-static void smc_set_arg(seL4_UserContext *u, uint64_t arg, uint64_t val)
+static void smc_set_arg(struct fault_ctx *ctx, uint64_t arg, uint64_t val)
 {
     switch (arg) {
-        case 1: u->x1 = val; break;
-        case 2: u->x2 = val; break;
-        case 3: u->x3 = val; break;
-        case 4: u->x4 = val; break;
-        case 5: u->x5 = val; break;
-        case 6: u->x6 = val; break;
+        case 1: fault_ctx_set_reg(ctx, FAULT_REG_X1, val); break;
+        case 2: fault_ctx_set_reg(ctx, FAULT_REG_X2, val); break;
+        case 3: fault_ctx_set_reg(ctx, FAULT_REG_X3, val); break;
+        case 4: fault_ctx_set_reg(ctx, FAULT_REG_X4, val); break;
+        case 5: fault_ctx_set_reg(ctx, FAULT_REG_X5, val); break;
+        case 6: fault_ctx_set_reg(ctx, FAULT_REG_X6, val); break;
         default:
             LOG_VMM_ERR("trying to set SMC arg: 0x%lx, with val: 0x%lx, SMC only has 6 argument registers\n", arg, val);
     }
 }
 
 // @ivanv: print out which SMC call as a string we can't handle.
-bool handle_smc(uint64_t vcpu_id, uint32_t hsr)
+bool handle_smc(uint64_t vcpu_id, struct fault_ctx *ctx, uint32_t hsr)
 {
-    // @ivanv: An optimisation to be made is to store the TCB registers so we don't
-    // end up reading them multiple times
-    seL4_UserContext regs;
-    int err = seL4_TCB_ReadRegisters(BASE_VM_TCB_CAP + GUEST_ID, false, 0, SEL4_USER_CONTEXT_SIZE, &regs);
-    assert(err == seL4_NoError);
-
-    uint64_t fn_number = smc_get_function_number(&regs);
-    smc_call_id_t service = smc_get_call(regs.x0);
+    uint64_t fn_number = smc_get_function_number(ctx);
+    smc_call_id_t service = smc_get_call(fault_ctx_get_reg(ctx, FAULT_REG_X0));
 
     switch (service) {
         case SMC_CALL_STD_SERVICE:
             if (fn_number < PSCI_MAX) {
-                return handle_psci(vcpu_id, &regs, fn_number, hsr);
+                return handle_psci(vcpu_id, ctx, fn_number, hsr);
             }
             LOG_VMM_ERR("Unhandled SMC: standard service call %lu\n", fn_number);
             break;
@@ -10,12 +10,13 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <microkit.h>
+#include "fault.h"
 
 // SMC vCPU fault handler
-bool handle_smc(uint64_t vcpu_id, uint32_t hsr);
+bool handle_smc(uint64_t vcpu_id, struct fault_ctx *ctx, uint32_t hsr);
 
 // Helper functions
-void smc_set_return_value(seL4_UserContext *u, uint64_t val);
+void smc_set_return_value(struct fault_ctx *ctx, uint64_t val);
 
 /* Gets the value of x1-x6 */
-uint64_t smc_get_arg(seL4_UserContext *u, uint64_t arg);
+uint64_t smc_get_arg(struct fault_ctx *ctx, uint64_t arg);
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2023, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * The formats are described in the LZ4 repository:
+ * https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+ * https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md (legacy frame)
+ */
+
+#include "util.h"
+#include "lz4.h"
+
+#define LZ4_LEGACY_MAGIC        0x184c2102
+#define LZ4_LEGACY_BLOCK_SIZE   (8 * 1024 * 1024)
+
+/* A match is at least 4 bytes, the length in the token is on top of that */
+#define LZ4_MIN_MATCH           4
+
+static inline uint32_t lz4_read_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Lengths that don't fit in the 4 bits of the token are continued in bytes
+ * that follow, for as long as the bytes are 255.
+ */
+static inline bool lz4_read_length(const uint8_t **in, const uint8_t *in_end, size_t *len)
+{
+    uint8_t b;
+    do {
+        if (*in == in_end) {
+            return false;
+        }
+        b = *(*in)++;
+        *len += b;
+    } while (b == 255);
+
+    return true;
+}
+
+static bool lz4_decompress_block(const uint8_t *in, const uint8_t *in_end, uint8_t **out, uint8_t *out_end)
+{
+    uint8_t *block_start = *out;
+    uint8_t *o = *out;
+    while (in < in_end) {
+        uint8_t token = *in++;
+
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && !lz4_read_length(&in, in_end, &literal_len)) {
+            return false;
+        }
+        if (literal_len > (size_t)(in_end - in) || literal_len > (size_t)(out_end - o)) {
+            return false;
+        }
+        memcpy(o, in, literal_len);
+        o += literal_len;
+        in += literal_len;
+
+        /* The last sequence of a block only has literals */
+        if (in == in_end) {
+            break;
+        }
+
+        if (in_end - in < 2) {
+            return false;
+        }
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        /* Blocks in the legacy format are independent */
+        if (offset == 0 || offset > (size_t)(o - block_start)) {
+            return false;
+        }
+
+        size_t match_len = token & 0xf;
+        if (match_len == 15 && !lz4_read_length(&in, in_end, &match_len)) {
+            return false;
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > (size_t)(out_end - o)) {
+            return false;
+        }
+
+        const uint8_t *match = o - offset;
+        if (offset >= match_len) {
+            memcpy(o, match, match_len);
+            o += match_len;
+        } else {
+            /* The match overlaps what it produces, e.g a run of one byte */
+            for (size_t i = 0; i < match_len; i++) {
+                *o++ = *match++;
+            }
+        }
+    }
+
+    *out = o;
+    return true;
+}
+
+bool lz4_legacy_decompress(const void *src, size_t src_size, void *dst, size_t dst_size, size_t *dst_len)
+{
+    const uint8_t *in = src;
+    const uint8_t *in_end = in + src_size;
+    uint8_t *out = dst;
+    uint8_t *out_end = out + dst_size;
+
+    if (src_size < sizeof(uint32_t) || lz4_read_le32(in) != LZ4_LEGACY_MAGIC) {
+        LOG_VMM_ERR("LZ4 data does not start with the legacy frame magic\n");
+        return false;
+    }
+
+    while (in_end - in >= sizeof(uint32_t)) {
+        uint32_t block_size = lz4_read_le32(in);
+        in += sizeof(uint32_t);
+        /* Concatenated frames each start with the magic again */
+        if (block_size == LZ4_LEGACY_MAGIC) {
+            continue;
+        }
+        if (block_size > (size_t)(in_end - in)) {
+            LOG_VMM_ERR("LZ4 block of 0x%x bytes is truncated\n", block_size);
+            return false;
+        }
+        uint8_t *block_out_end = out_end;
+        if ((size_t)(out_end - out) > LZ4_LEGACY_BLOCK_SIZE) {
+            block_out_end = out + LZ4_LEGACY_BLOCK_SIZE;
+        }
+        if (!lz4_decompress_block(in, in + block_size, &out, block_out_end)) {
+            LOG_VMM_ERR("LZ4 block at offset 0x%lx is malformed or does not fit\n", in - (const uint8_t *)src);
+            return false;
+        }
+        in += block_size;
+    }
+
+    if (in != in_end) {
+        LOG_VMM_ERR("LZ4 data has %ld trailing bytes\n", in_end - in);
+        return false;
+    }
+
+    *dst_len = out - (uint8_t *)dst;
+    return true;
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright 2023, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Decompress data in the LZ4 legacy format (what `lz4 -l` produces, and what
+ * Linux uses for compressed kernels). This is a sequence of frames, each made
+ * up of a magic number followed by blocks that are at most 8MiB decompressed.
+ *
+ * The data is decompressed straight into `dst`, which matches refer back into,
+ * so no buffer is needed besides the destination. Returns false if the data
+ * is malformed or does not fit in `dst_size` bytes, otherwise the number of
+ * decompressed bytes is stored in `dst_len`.
+ */
+bool lz4_legacy_decompress(const void *src, size_t src_size, void *dst, size_t dst_size, size_t *dst_len);
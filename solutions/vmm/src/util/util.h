@@ -12,9 +12,20 @@
 #include "printf.h"
 
 // @ivanv: these are here for convience, should not be here though
-#define GUEST_ID 0
-#define GUEST_VCPU_ID 0
+/*
+ * The guest's vCPUs, the ID of a vCPU is the same as the one given to it in
+ * the system description (and hence what Microkit uses to refer to it). This
+ * has to match the number of CPUs in the guest's device tree.
+ *
+ * Each vCPU needs its own MPIDR, which seL4 only lets us set on SMP kernels,
+ * so on a uniprocessor kernel the guest only gets the boot vCPU.
+ */
+#define GUEST_BOOT_VCPU_ID 0
+#if CONFIG_MAX_NUM_NODES > 1
+#define GUEST_NUM_VCPUS 2
+#else
 #define GUEST_NUM_VCPUS 1
+#endif
 // Note that this is AArch64 specific
 #if defined(CONFIG_ARCH_AARCH64)
     #define SEL4_USER_CONTEXT_SIZE 0x24
@@ -156,10 +167,112 @@ print_vcpu_regs(uint64_t vcpu_id) {
     printf("    CNTKCTL_EL1: 0x%lx\n", microkit_vcpu_arm_read_reg(vcpu_id, seL4_VCPUReg_CNTKCTL_EL1));
 }
 
+/*
+ * memcpy and memset get used for entire guest images and all of guest RAM, so
+ * they move a word at a time (four words per iteration, as two pairs of
+ * LDP/STP) rather than a byte at a time. We are built with -mstrict-align, so
+ * only the bytes before the first aligned word and after the last one are
+ * done separately.
+ */
+typedef uint64_t __attribute__((__may_alias__)) util_word_t;
+
+#define UTIL_WORD_SIZE sizeof(util_word_t)
+#define UTIL_WORD_ALIGNED(p) (((uintptr_t)(p) & (UTIL_WORD_SIZE - 1)) == 0)
+
+/* Data Cache Zero ID register */
+#define DCZID_BS_MASK   0xf
+#define DCZID_DZP       (1 << 4)
+
+#if defined(VMM_HOST_TEST)
+/* Built and run on the host by the tests (see vmm/test), which emulate DC ZVA */
+size_t dc_zva_block_size(void);
+void dc_zva(void *p);
+#else
+/*
+ * The size of the block that DC ZVA zeroes, or 0 if we are not allowed to
+ * use it.
+ */
+static inline size_t dc_zva_block_size(void)
+{
+#if defined(CONFIG_ARCH_AARCH64)
+    uint64_t dczid;
+    asm volatile("mrs %0, dczid_el0" : "=r"(dczid));
+    if (dczid & DCZID_DZP) {
+        return 0;
+    }
+    /* The block size is given as log2 of the number of 4 byte words */
+    return 4UL << (dczid & DCZID_BS_MASK);
+#else
+    return 0;
+#endif
+}
+
+/* Zero the block that p is in, p has to be aligned to dc_zva_block_size() */
+static inline void dc_zva(void *p)
+{
+#if defined(CONFIG_ARCH_AARCH64)
+    asm volatile("dc zva, %0" :: "r"(p) : "memory");
+#endif
+}
+#endif
+
+/*
+ * Copy and set four words with two LDP/STP pairs. This is written out in
+ * assembly since the VMM is built without optimisation, and the compiler would
+ * otherwise do one word per load and store.
+ */
+static inline void util_copy_4_words(util_word_t *d, const util_word_t *s)
+{
+#if defined(CONFIG_ARCH_AARCH64) && !defined(VMM_HOST_TEST)
+    util_word_t w0, w1, w2, w3;
+    asm volatile("ldp %0, %1, [%4]\n"
+                 "ldp %2, %3, [%4, #16]\n"
+                 "stp %0, %1, [%5]\n"
+                 "stp %2, %3, [%5, #16]\n"
+                 : "=&r"(w0), "=&r"(w1), "=&r"(w2), "=&r"(w3)
+                 : "r"(s), "r"(d)
+                 : "memory");
+#else
+    util_word_t w0 = s[0], w1 = s[1], w2 = s[2], w3 = s[3];
+    d[0] = w0;
+    d[1] = w1;
+    d[2] = w2;
+    d[3] = w3;
+#endif
+}
+
+static inline void util_set_4_words(util_word_t *d, util_word_t w)
+{
+#if defined(CONFIG_ARCH_AARCH64) && !defined(VMM_HOST_TEST)
+    asm volatile("stp %1, %1, [%0]\n"
+                 "stp %1, %1, [%0, #16]\n"
+                 :
+                 : "r"(d), "r"(w)
+                 : "memory");
+#else
+    d[0] = w;
+    d[1] = w;
+    d[2] = w;
+    d[3] = w;
+#endif
+}
+
 static void *memcpy(void *restrict dest, const void *restrict src, size_t n)
 {
     unsigned char *d = dest;
     const unsigned char *s = src;
+    /* Copying words only works if both can be word aligned at once */
+    if (((uintptr_t)d & (UTIL_WORD_SIZE - 1)) == ((uintptr_t)s & (UTIL_WORD_SIZE - 1))) {
+        for (; n && !UTIL_WORD_ALIGNED(d); n--) *d++ = *s++;
+        util_word_t *dw = (util_word_t *)d;
+        const util_word_t *sw = (const util_word_t *)s;
+        for (; n >= 4 * UTIL_WORD_SIZE; n -= 4 * UTIL_WORD_SIZE, dw += 4, sw += 4) {
+            util_copy_4_words(dw, sw);
+        }
+        for (; n >= UTIL_WORD_SIZE; n -= UTIL_WORD_SIZE) *dw++ = *sw++;
+        d = (unsigned char *)dw;
+        s = (const unsigned char *)sw;
+    }
     for (; n; n--) *d++ = *s++;
     return dest;
 }
@@ -167,6 +280,26 @@ static void *memcpy(void *restrict dest, const void *restrict src, size_t n)
 static void *memset(void *dest, int c, size_t n)
 {
     unsigned char *s = dest;
+    for (; n && !UTIL_WORD_ALIGNED(s); n--, s++) *s = c;
+    if ((unsigned char)c == 0) {
+        /* Zero whole cache blocks without reading them in first */
+        size_t block_size = dc_zva_block_size();
+        if (block_size != 0 && n >= block_size) {
+            for (; ((uintptr_t)s & (block_size - 1)) != 0; n -= UTIL_WORD_SIZE, s += UTIL_WORD_SIZE) {
+                *(util_word_t *)s = 0;
+            }
+            for (; n >= block_size; n -= block_size, s += block_size) {
+                dc_zva(s);
+            }
+        }
+    }
+    util_word_t w = (unsigned char)c * 0x0101010101010101ULL;
+    util_word_t *sw = (util_word_t *)s;
+    for (; n >= 4 * UTIL_WORD_SIZE; n -= 4 * UTIL_WORD_SIZE, sw += 4) {
+        util_set_4_words(sw, w);
+    }
+    for (; n >= UTIL_WORD_SIZE; n -= UTIL_WORD_SIZE) *sw++ = w;
+    s = (unsigned char *)sw;
     for (; n; n--, s++) *s = c;
     return dest;
 }
@@ -178,7 +311,11 @@ static void assert_fail(
     const char  *function)
 {
     printf("Failed assertion '%s' at %s:%u in function %s\n", assertion, file, line, function);
+#if defined(VMM_HOST_TEST)
+    __builtin_trap();
+#else
     while (1) {}
+#endif
 }
 
 #define assert(expr) \
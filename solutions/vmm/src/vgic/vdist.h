@@ -15,6 +15,20 @@
 #define IRQ_IDX(irq) ((irq) / 32)
 #define IRQ_BIT(irq) (1U << ((irq) % 32))
 
+/* Only the priority bits implemented by the virtual CPU interface, the rest are RAZ/WI */
+#define GIC_DIST_PRIORITY_MASK 0xf8f8f8f8
+/* Only the edge/level bit of each ICFGR field can be written */
+#define GIC_DIST_CONFIG_MASK 0xaaaaaaaa
+
+// @ivanv: I don't understand why GIC v2 is group 0 and GIC v3 is group 1.
+#if defined(GIC_V2)
+#define VGIC_LR_GROUP 0
+#elif defined(GIC_V3)
+#define VGIC_LR_GROUP 1
+#else
+#error "Unknown GIC version"
+#endif
+
 static inline void set_sgi_ppi_pending(struct gic_dist_map *gic_dist, int irq, bool set_pending, int vcpu_id)
 {
     if (set_pending) {
@@ -115,6 +129,47 @@ static inline bool is_enabled(struct gic_dist_map *gic_dist, int irq, int vcpu_i
     }
 }
 
+/*
+ * Each IRQ has two configuration bits in ICFGR, the upper one is set for
+ * edge-triggered IRQs and clear for level-sensitive ones.
+ */
+static inline bool is_edge_triggered(struct gic_dist_map *gic_dist, int irq)
+{
+    return !!(gic_dist->config[irq / 16] & (1U << ((irq % 16) * 2 + 1)));
+}
+
+/*
+ * We keep an IRQ pending in the distributor until the guest EOIs it, so an
+ * edge that arrives before then would otherwise be lost. Instead we remember
+ * it and make the IRQ pending again once the guest is done with it.
+ */
+static inline void vgic_latch_irq(vgic_t *vgic, uint64_t vcpu_id, int irq)
+{
+    if (irq < NUM_VCPU_LOCAL_VIRQS) {
+        get_vgic_vcpu(vgic, vcpu_id)->local_latched |= IRQ_BIT(irq);
+    } else {
+        int spi = irq - NUM_VCPU_LOCAL_VIRQS;
+        vgic->spi_latched[IRQ_IDX(spi)] |= IRQ_BIT(spi);
+    }
+}
+
+static inline bool vgic_take_latched_irq(vgic_t *vgic, uint64_t vcpu_id, int irq)
+{
+    uint32_t *latched;
+    uint32_t bit;
+    if (irq < NUM_VCPU_LOCAL_VIRQS) {
+        latched = &get_vgic_vcpu(vgic, vcpu_id)->local_latched;
+        bit = IRQ_BIT(irq);
+    } else {
+        int spi = irq - NUM_VCPU_LOCAL_VIRQS;
+        latched = &vgic->spi_latched[IRQ_IDX(spi)];
+        bit = IRQ_BIT(spi);
+    }
+    bool was_latched = !!(*latched & bit);
+    *latched &= ~bit;
+    return was_latched;
+}
+
 static inline bool is_sgi_ppi_active(struct gic_dist_map *gic_dist, int irq, int vcpu_id)
 {
     return !!(gic_dist->active0[vcpu_id] & IRQ_BIT(irq));
@@ -134,6 +189,51 @@ static inline bool is_active(struct gic_dist_map *gic_dist, int irq, int vcpu_id
     }
 }
 
+#if defined(GIC_V2)
+/* Each byte of ITARGETSR can only target CPU interfaces that have a vCPU */
+#define GIC_DIST_TARGETS_MASK (0x01010101 * ((1 << GUEST_NUM_VCPUS) - 1))
+#endif
+
+/*
+ * The vCPU the guest wants an SPI delivered to. If the guest allows the SPI
+ * to go to more than one vCPU we use the first of them, and if it has not
+ * given us a vCPU that exists the SPI goes to the boot vCPU.
+ */
+static inline uint64_t vgic_dist_get_spi_target(struct gic_dist_map *gic_dist, int irq)
+{
+    int spi = irq - NUM_VCPU_LOCAL_VIRQS;
+    assert(spi >= 0);
+#if defined(GIC_V2)
+    uint32_t reg = gic_dist->targets[spi / 4];
+    uint32_t targets = (reg >> ((spi % 4) * 8)) & 0xff;
+    if (targets == 0) {
+        return GUEST_BOOT_VCPU_ID;
+    }
+    return CTZ(targets);
+#elif defined(GIC_V3)
+    if (spi >= ARRAY_SIZE(gic_dist->irouter)) {
+        return GUEST_BOOT_VCPU_ID;
+    }
+    uint64_t route = gic_dist->irouter[spi];
+    uint64_t target = route & GIC_DIST_IROUTER_AFF0;
+    if ((route & GIC_DIST_IROUTER_IRM) || target >= GUEST_NUM_VCPUS) {
+        return GUEST_BOOT_VCPU_ID;
+    }
+    return target;
+#endif
+}
+
+static inline uint8_t vgic_dist_get_priority(struct gic_dist_map *gic_dist, int irq, int vcpu_id)
+{
+    uint32_t reg;
+    if (irq < NUM_VCPU_LOCAL_VIRQS) {
+        reg = gic_dist->priority0[vcpu_id][irq / 4];
+    } else {
+        reg = gic_dist->priority[(irq - NUM_VCPU_LOCAL_VIRQS) / 4];
+    }
+    return (reg >> ((irq % 4) * 8)) & 0xff;
+}
+
 static void vgic_dist_enable_irq(vgic_t *vgic, uint64_t vcpu_id, int irq)
 {
     LOG_DIST("Enabling IRQ %d\n", irq);
@@ -176,6 +276,11 @@ static bool vgic_dist_set_pending_irq(vgic_t *vgic, uint64_t vcpu_id, int irq)
     // been registered. This is not good.
     /* STATE c) */
 
+    if (irq >= NUM_VCPU_LOCAL_VIRQS) {
+        /* SPIs go to whichever vCPU the guest has routed them to */
+        vcpu_id = vgic_dist_get_spi_target(vgic_get_dist(vgic->registers), irq);
+    }
+
     struct virq_handle *virq_data = virq_find_irq_data(vgic, vcpu_id, irq);
     struct gic_dist_map *dist = vgic_get_dist(vgic->registers);
 
@@ -189,21 +294,31 @@ static bool vgic_dist_set_pending_irq(vgic_t *vgic, uint64_t vcpu_id, int irq)
         if (!is_enabled(dist, irq, vcpu_id)) {
             LOG_DIST("vIRQ is not enabled\n");
         }
+        VGIC_STAT_INC(vgic, dropped);
         return false;
     }
 
     if (is_pending(dist, virq_data->virq, vcpu_id)) {
-        // Do nothing if it's already pending
+        /*
+         * A level-sensitive IRQ is just as asserted as it was, but another
+         * edge has to be delivered after the one the guest is handling.
+         */
+        if (is_edge_triggered(dist, virq_data->virq)) {
+            vgic_latch_irq(vgic, vcpu_id, virq_data->virq);
+            VGIC_STAT_INC(vgic, latched);
+        }
         return true;
     }
 
     LOG_DIST("Pending set: Inject IRQ from pending set (%d)\n", irq);
     set_pending(dist, virq_data->virq, true, vcpu_id);
+    VGIC_STAT_INC(vgic, injected);
 
-    /* Enqueueing an IRQ and dequeueing it right after makes little sense
-     * now, but in the future this is needed to support IRQ priorities.
+    /* The IRQ goes through the queue so that, if there is a list register
+     * free, the highest priority pending IRQ is the one that gets it.
      */
-    bool success = vgic_irq_enqueue(vgic, vcpu_id, virq_data);
+    uint8_t priority = vgic_dist_get_priority(dist, virq_data->virq, vcpu_id);
+    bool success = vgic_irq_enqueue(vgic, vcpu_id, virq_data, priority);
     if (!success) {
         LOG_VMM_ERR("Failure enqueueing IRQ, increase MAX_IRQ_QUEUE_LEN");
         assert(0);
@@ -215,34 +330,37 @@ static bool vgic_dist_set_pending_irq(vgic_t *vgic, uint64_t vcpu_id, int irq)
         /* There were no empty list registers available, but that's not a big
          * deal -- we have already enqueued this IRQ and eventually the vGIC
          * maintenance code will load it to a list register from the queue.
+         * We do not swap out a lower priority IRQ to make room for it: a
+         * list register the guest has EOI'd but whose maintenance fault we
+         * have not handled yet looks the same as a pending one, and
+         * overwriting it would lose that EOI.
          */
+        VGIC_STAT_INC(vgic, queued);
         return true;
     }
 
-    struct virq_handle *virq = vgic_irq_dequeue(vgic, vcpu_id);
+    struct virq_handle *virq = vgic_irq_dequeue(vgic, vcpu_id, &priority);
     assert(virq->virq != VIRQ_INVALID);
 
-#if defined(GIC_V2)
-    int group = 0;
-#elif defined(GIC_V3)
-    int group = 1;
-#else
-#error "Unknown GIC version"
-#endif
+    success = vgic_vcpu_load_list_reg(vgic, vcpu_id, idx, VGIC_LR_GROUP, virq, priority);
+    if (!success) {
+        LOG_VMM_ERR("Failed to load IRQ %d into list register %d\n", virq->virq, idx);
+    }
+    VGIC_STAT_INC(vgic, loaded);
 
-    // @ivanv: I don't understand why GIC v2 is group 0 and GIC v3 is group 1.
-    return vgic_vcpu_load_list_reg(vgic, vcpu_id, idx, group, virq);
+    return success;
 }
 
-static void vgic_dist_clr_pending_irq(struct gic_dist_map *dist, uint32_t vcpu_id, int irq)
+static void vgic_dist_clr_pending_irq(vgic_t *vgic, uint32_t vcpu_id, int irq)
 {
     LOG_DIST("Clear pending IRQ %d\n", irq);
-    set_pending(dist, irq, false, vcpu_id);
+    set_pending(vgic_get_dist(vgic->registers), irq, false, vcpu_id);
+    vgic_take_latched_irq(vgic, vcpu_id, irq);
     /* TODO: remove from IRQ queue and list registers as well */
     // @ivanv
 }
 
-static bool vgic_dist_reg_read(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset, uint64_t fsr, seL4_UserContext *regs)
+static bool vgic_dist_reg_read(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset, uint64_t fsr, struct fault_ctx *ctx)
 {
     bool success = false;
     struct gic_dist_map *gic_dist = vgic_get_dist(vgic->registers);
@@ -397,14 +515,14 @@ static bool vgic_dist_reg_read(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset,
     default:
         LOG_VMM_ERR("Unknown register offset 0x%x", offset);
         // err = ignore_fault(fault);
-        success = fault_advance_vcpu(regs);
+        success = fault_advance_vcpu(ctx);
         assert(success);
         goto fault_return;
     }
     uint32_t mask = fault_get_data_mask(GIC_DIST_PADDR + offset, fsr);
     // fault_set_data(fault, reg & mask);
     // @ivanv: interesting, when we don't call fault_Set_data in the CAmkES VMM, everything works fine?...
-    success = fault_advance(regs, GIC_DIST_PADDR + offset, fsr, reg & mask);
+    success = fault_advance(ctx, GIC_DIST_PADDR + offset, fsr, reg & mask);
     assert(success);
 
 fault_return:
@@ -415,12 +533,12 @@ fault_return:
     return success;
 }
 
-static inline void emulate_reg_write_access(seL4_UserContext *regs, uint64_t addr, uint64_t fsr, uint32_t *reg)
+static inline void emulate_reg_write_access(struct fault_ctx *ctx, uint64_t addr, uint64_t fsr, uint32_t *reg)
 {
-    *reg = fault_emulate(regs, *reg, addr, fsr, fault_get_data(regs, fsr));
+    *reg = fault_emulate(ctx, *reg, addr, fsr, fault_get_data(ctx, fsr));
 }
 
-static bool vgic_dist_reg_write(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset, uint64_t fsr, seL4_UserContext *regs)
+static bool vgic_dist_reg_write(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset, uint64_t fsr, struct fault_ctx *ctx)
 {
     bool success = true;
     struct gic_dist_map *gic_dist = vgic_get_dist(vgic->registers);
@@ -430,7 +548,7 @@ static bool vgic_dist_reg_write(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset,
     uint32_t data;
     switch (offset) {
     case RANGE32(GIC_DIST_CTLR, GIC_DIST_CTLR):
-        data = fault_get_data(regs, fsr);
+        data = fault_get_data(ctx, fsr);
         if (data == GIC_ENABLED) {
             vgic_dist_enable(gic_dist);
         } else if (data == 0) {
@@ -462,14 +580,14 @@ static bool vgic_dist_reg_write(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset,
         /* Reserved */
         break;
     case RANGE32(GIC_DIST_IGROUPR0, GIC_DIST_IGROUPR0):
-        emulate_reg_write_access(regs, addr, fsr, &gic_dist->irq_group0[vcpu_id]);
+        emulate_reg_write_access(ctx, addr, fsr, &gic_dist->irq_group0[vcpu_id]);
         break;
     case RANGE32(GIC_DIST_IGROUPR1, GIC_DIST_IGROUPRN):
         reg_offset = GIC_DIST_REGN(offset, GIC_DIST_IGROUPR1);
-        emulate_reg_write_access(regs, addr, fsr, &gic_dist->irq_group[reg_offset]);
+        emulate_reg_write_access(ctx, addr, fsr, &gic_dist->irq_group[reg_offset]);
         break;
     case RANGE32(GIC_DIST_ISENABLER0, GIC_DIST_ISENABLERN):
-        data = fault_get_data(regs, fsr);
+        data = fault_get_data(ctx, fsr);
         /* Mask the data to write */
         data &= mask;
         while (data) {
@@ -481,7 +599,7 @@ static bool vgic_dist_reg_write(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset,
         }
         break;
     case RANGE32(GIC_DIST_ICENABLER0, GIC_DIST_ICENABLERN):
-        data = fault_get_data(regs, fsr);
+        data = fault_get_data(ctx, fsr);
         /* Mask the data to write */
         data &= mask;
         while (data) {
@@ -493,7 +611,7 @@ static bool vgic_dist_reg_write(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset,
         }
         break;
     case RANGE32(GIC_DIST_ISPENDR0, GIC_DIST_ISPENDRN):
-        data = fault_get_data(regs, fsr);
+        data = fault_get_data(ctx, fsr);
         /* Mask the data to write */
         data &= mask;
         while (data) {
@@ -506,7 +624,7 @@ static bool vgic_dist_reg_write(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset,
         }
         break;
     case RANGE32(GIC_DIST_ICPENDR0, GIC_DIST_ICPENDRN):
-        data = fault_get_data(regs, fsr);
+        data = fault_get_data(ctx, fsr);
         /* Mask the data to write */
         data &= mask;
         while (data) {
@@ -514,29 +632,46 @@ static bool vgic_dist_reg_write(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset,
             irq = CTZ(data);
             data &= ~(1U << irq);
             irq += (offset - GIC_DIST_ICPENDR0) * 8;
-            vgic_dist_clr_pending_irq(gic_dist, vcpu_id, irq);
+            vgic_dist_clr_pending_irq(vgic, vcpu_id, irq);
         }
         break;
     case RANGE32(GIC_DIST_ISACTIVER0, GIC_DIST_ISACTIVER0):
-        emulate_reg_write_access(regs, addr, fsr, &gic_dist->active0[vcpu_id]);
+        emulate_reg_write_access(ctx, addr, fsr, &gic_dist->active0[vcpu_id]);
         break;
     case RANGE32(GIC_DIST_ISACTIVER1, GIC_DIST_ISACTIVERN):
         reg_offset = GIC_DIST_REGN(offset, GIC_DIST_ISACTIVER1);
-        emulate_reg_write_access(regs, addr, fsr, &gic_dist->active[reg_offset]);
+        emulate_reg_write_access(ctx, addr, fsr, &gic_dist->active[reg_offset]);
         break;
     case RANGE32(GIC_DIST_ICACTIVER0, GIC_DIST_ICACTIVER0):
-        emulate_reg_write_access(regs, addr, fsr, &gic_dist->active_clr0[vcpu_id]);
+        emulate_reg_write_access(ctx, addr, fsr, &gic_dist->active_clr0[vcpu_id]);
         break;
     case RANGE32(GIC_DIST_ICACTIVER1, GIC_DIST_ICACTIVERN):
         reg_offset = GIC_DIST_REGN(offset, GIC_DIST_ICACTIVER1);
-        emulate_reg_write_access(regs, addr, fsr, &gic_dist->active_clr[reg_offset]);
+        emulate_reg_write_access(ctx, addr, fsr, &gic_dist->active_clr[reg_offset]);
+        break;
+    case RANGE32(GIC_DIST_IPRIORITYR0, GIC_DIST_IPRIORITYR7):
+        reg_offset = GIC_DIST_REGN(offset, GIC_DIST_IPRIORITYR0);
+        emulate_reg_write_access(ctx, addr, fsr, &gic_dist->priority0[vcpu_id][reg_offset]);
+        gic_dist->priority0[vcpu_id][reg_offset] &= GIC_DIST_PRIORITY_MASK;
         break;
-    case RANGE32(GIC_DIST_IPRIORITYR0, GIC_DIST_IPRIORITYRN):
+    case RANGE32(GIC_DIST_IPRIORITYR8, GIC_DIST_IPRIORITYRN):
+        reg_offset = GIC_DIST_REGN(offset, GIC_DIST_IPRIORITYR8);
+        emulate_reg_write_access(ctx, addr, fsr, &gic_dist->priority[reg_offset]);
+        gic_dist->priority[reg_offset] &= GIC_DIST_PRIORITY_MASK;
         break;
     case RANGE32(0x7FC, 0x7FC):
         /* Reserved */
         break;
-    case RANGE32(GIC_DIST_ITARGETSR0, GIC_DIST_ITARGETSRN):
+    case RANGE32(GIC_DIST_ITARGETSR0, GIC_DIST_ITARGETSR7):
+        /* The targets of SGIs and PPIs are fixed to the vCPU they belong to */
+        break;
+    case RANGE32(GIC_DIST_ITARGETSR8, GIC_DIST_ITARGETSRN):
+#if defined(GIC_V2)
+        reg_offset = GIC_DIST_REGN(offset, GIC_DIST_ITARGETSR8);
+        emulate_reg_write_access(ctx, addr, fsr, &gic_dist->targets[reg_offset]);
+        gic_dist->targets[reg_offset] &= GIC_DIST_TARGETS_MASK;
+#endif
+        /* With affinity routing (GICv3) SPIs are routed with IROUTER instead */
         break;
     case RANGE32(0xBFC, 0xBFC):
         /* Reserved */
@@ -544,10 +679,18 @@ static bool vgic_dist_reg_write(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset,
     case RANGE32(GIC_DIST_ICFGR0, GIC_DIST_ICFGRN):
         /*
          * Emulate accesses to interrupt configuration registers to set the IRQ
-         * to be edge-triggered or level-sensitive.
+         * to be edge-triggered or level-sensitive. This decides whether an
+         * IRQ that arrives while it is still pending or active is latched.
+         * SGIs are always edge-triggered and the lower bit of each field is
+         * reserved.
          */
         reg_offset = GIC_DIST_REGN(offset, GIC_DIST_ICFGR0);
-        emulate_reg_write_access(regs, addr, fsr, &gic_dist->config[reg_offset]);
+        if (reg_offset != 0) {
+            uint32_t config = gic_dist->config[reg_offset];
+            emulate_reg_write_access(ctx, addr, fsr, &gic_dist->config[reg_offset]);
+            gic_dist->config[reg_offset] = (gic_dist->config[reg_offset] & GIC_DIST_CONFIG_MASK) |
+                                           (config & ~GIC_DIST_CONFIG_MASK);
+        }
         break;
     case RANGE32(0xD00, 0xDFC):
         /* IMPLEMENTATION DEFINED registers. */
@@ -556,7 +699,7 @@ static bool vgic_dist_reg_write(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset,
         /* GIC_DIST_NSACR [0xE00 - 0xF00) - Not supported */
         break;
     case RANGE32(GIC_DIST_SGIR, GIC_DIST_SGIR):
-        data = fault_get_data(regs, fsr);
+        data = fault_get_data(ctx, fsr);
         int mode = (data & GIC_DIST_SGI_TARGET_LIST_FILTER_MASK) >> GIC_DIST_SGI_TARGET_LIST_FILTER_SHIFT;
         int virq = (data & GIC_DIST_SGI_INTID_MASK);
         uint16_t target_list = 0;
@@ -578,11 +721,19 @@ static bool vgic_dist_reg_write(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset,
             LOG_VMM_ERR("Unknown SGIR Target List Filter mode");
             goto ignore_fault;
         }
-        // @ivanv: Here we're making the assumption that there's only one vCPU, and
-        // we're also blindly injectnig the given IRQ to that vCPU.
-        // @ivanv: come back to this, do we have two writes to the TCB registers?
-        success = vgic_inject_irq(vcpu_id, virq);
-        assert(success);
+        /* CPU interfaces that do not have a vCPU behind them are ignored */
+        target_list &= (1 << GUEST_NUM_VCPUS) - 1;
+        while (target_list) {
+            int target = CTZ(target_list);
+            target_list &= ~(1U << target);
+            /*
+             * Not being able to inject the SGI is not an error on the sending
+             * vCPU's side, e.g the target may not have been turned on yet.
+             */
+            if (!vgic_dist_set_pending_irq(vgic, target, virq)) {
+                LOG_DIST("SGI %d from vCPU %d dropped on vCPU %d\n", virq, vcpu_id, target);
+            }
+        }
         break;
     case RANGE32(0xF04, 0xF0C):
         /* Reserved */
@@ -599,11 +750,15 @@ static bool vgic_dist_reg_write(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset,
         /* IMPLEMENTATION DEFINED registers. */
         break;
 #if defined(GIC_V3)
-    // @ivanv: explain GICv3 specific stuff, and also don't use the hardcoded valuees
-    case RANGE32(0x6100, 0x7F00):
-    // @ivanv revisit
-        // data = fault_get_data(fault);
-        // ZF_LOGF_IF(data, "bad dist: 0x%x 0x%x", offset, data);
+    // @ivanv: explain GICv3 specific stuff
+    case RANGE32(GIC_DIST_IROUTER0, GIC_DIST_IROUTER0 + sizeof(gic_dist->irouter) - sizeof(uint32_t)):
+        /*
+         * We only route on affinity level 0 and the routing mode, which are
+         * both in the lower half of each IROUTER, so we emulate accesses one
+         * 32-bit word at a time.
+         */
+        reg_offset = GIC_DIST_REGN(offset, GIC_DIST_IROUTER0);
+        emulate_reg_write_access(ctx, addr, fsr, &((uint32_t *)gic_dist->irouter)[reg_offset]);
         break;
 #endif
     default:
@@ -616,7 +771,7 @@ ignore_fault:
         return false;
     }
 
-    success = fault_advance_vcpu(regs);
+    success = fault_advance_vcpu(ctx);
     assert(success);
 
     return success;
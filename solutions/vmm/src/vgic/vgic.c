@@ -23,6 +23,30 @@
 /* The driver expects the VGIC state to be initialised before calling any of the driver functionality. */
 extern vgic_t vgic;
 
+/*
+ * Move as many IRQs as we can from the overflow queue into list registers.
+ * The kernel only tells us about one completed list register per maintenance
+ * fault, but other list registers may be free as well (for example if the
+ * queue was empty when they were last freed), so we fill all of them at once
+ * rather than one per fault.
+ */
+static bool vgic_vcpu_refill_list_regs(uint64_t vcpu_id)
+{
+    int idx;
+    while ((idx = vgic_find_empty_list_reg(&vgic, vcpu_id)) >= 0) {
+        uint8_t priority;
+        struct virq_handle *virq = vgic_irq_dequeue(&vgic, vcpu_id, &priority);
+        if (!virq) {
+            break;
+        }
+        if (!vgic_vcpu_load_list_reg(&vgic, vcpu_id, idx, VGIC_LR_GROUP, virq, priority)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 bool handle_vgic_maintenance(uint64_t vcpu_id)
 {
     // @ivanv: reivist, also inconsistency between int and bool
@@ -35,7 +59,7 @@ bool handle_vgic_maintenance(uint64_t vcpu_id)
     // @ivanv: Revisit and make sure it's still correct.
     vgic_vcpu_t *vgic_vcpu = get_vgic_vcpu(&vgic, vcpu_id);
     assert(vgic_vcpu);
-    assert((idx >= 0) && (idx < ARRAY_SIZE(vgic_vcpu->lr_shadow)));
+    assert((idx >= 0) && (idx < vgic.num_list_regs));
     struct virq_handle *slot = &vgic_vcpu->lr_shadow[idx];
     assert(slot->virq != VIRQ_INVALID);
     struct virq_handle lr_virq = *slot;
@@ -44,22 +68,16 @@ bool handle_vgic_maintenance(uint64_t vcpu_id)
     slot->ack_data = NULL;
     /* Clear pending */
     LOG_IRQ("Maintenance IRQ %d\n", lr_virq.virq);
+    VGIC_STAT_INC(&vgic, maintenance);
     set_pending(vgic_get_dist(vgic.registers), lr_virq.virq, false, vcpu_id);
     virq_ack(vcpu_id, &lr_virq);
-    /* Check the overflow list for pending IRQs */
-    struct virq_handle *virq = vgic_irq_dequeue(&vgic, vcpu_id);
-
-#if defined(GIC_V2)
-    int group = 0;
-#elif defined(GIC_V3)
-    int group = 1;
-#else
-#error "Unknown GIC version"
-#endif
-
-    if (virq) {
-        success = vgic_vcpu_load_list_reg(&vgic, vcpu_id, idx, group, virq);
+    /* Deliver the edge that arrived while the guest was handling the last one */
+    if (vgic_take_latched_irq(&vgic, vcpu_id, lr_virq.virq)) {
+        LOG_IRQ("Injecting latched IRQ %d\n", lr_virq.virq);
+        vgic_dist_set_pending_irq(&vgic, vcpu_id, lr_virq.virq);
     }
+    /* Check the overflow list for pending IRQs */
+    success = vgic_vcpu_refill_list_regs(vcpu_id);
 
     if (!success) {
         printf("VGIC|ERROR: maintenance handler failed\n");
@@ -81,6 +99,11 @@ bool vgic_register_irq(uint64_t vcpu_id, int virq_num, irq_ack_fn_t ack_fn, void
     return virq_add(vcpu_id, &vgic, &virq);
 }
 
+bool vgic_irq_is_edge_triggered(int irq)
+{
+    return is_edge_triggered(vgic_get_dist(vgic.registers), irq);
+}
+
 bool vgic_inject_irq(uint64_t vcpu_id, int irq)
 {
     LOG_IRQ("Injecting IRQ %d\n", irq);
@@ -92,12 +115,12 @@ bool vgic_inject_irq(uint64_t vcpu_id, int irq)
     // @ivanv: revist
     // if (!fault_handled(vcpu->vcpu_arch.fault) && fault_is_wfi(vcpu->vcpu_arch.fault)) {
     //     // ignore_fault(vcpu->vcpu_arch.fault);
-    //     err = advance_vcpu_fault(regs);
+    //     err = advance_vcpu_fault(ctx);
     // }
 }
 
 // @ivanv: revisit this whole function
-bool handle_vgic_dist_fault(uint64_t vcpu_id, uint64_t fault_addr, uint64_t fsr, seL4_UserContext *regs)
+bool handle_vgic_dist_fault(uint64_t vcpu_id, uint64_t fault_addr, uint64_t fsr, struct fault_ctx *ctx)
 {
     /* Make sure that the fault address actually lies within the GIC distributor region. */
     assert(fault_addr >= GIC_DIST_PADDR);
@@ -106,14 +129,29 @@ bool handle_vgic_dist_fault(uint64_t vcpu_id, uint64_t fault_addr, uint64_t fsr,
     uint64_t offset = fault_addr - GIC_DIST_PADDR;
     bool success = false;
     if (fault_is_read(fsr)) {
+        VGIC_STAT_INC(&vgic, dist_reads);
         // printf("VGIC|INFO: Read dist\n");
-        success = vgic_dist_reg_read(vcpu_id, &vgic, offset, fsr, regs);
+        success = vgic_dist_reg_read(vcpu_id, &vgic, offset, fsr, ctx);
         assert(success);
     } else {
+        VGIC_STAT_INC(&vgic, dist_writes);
         // printf("VGIC|INFO: Write dist\n");
-        success = vgic_dist_reg_write(vcpu_id, &vgic, offset, fsr, regs);
+        success = vgic_dist_reg_write(vcpu_id, &vgic, offset, fsr, ctx);
         assert(success);
     }
 
     return success;
-}
\ No newline at end of file
+}
+
+void vgic_print_stats(void)
+{
+#if defined(DEBUG_VGIC_STATS)
+    struct vgic_stats *stats = &vgic.stats;
+    printf("VGIC|INFO: distributor reads: %lu, writes: %lu\n", stats->dist_reads, stats->dist_writes);
+    printf("VGIC|INFO: IRQs injected: %lu, dropped: %lu, latched: %lu\n",
+           stats->injected, stats->dropped, stats->latched);
+    printf("VGIC|INFO: loaded into list registers: %lu, queued: %lu, maintenance: %lu\n",
+           stats->loaded, stats->queued, stats->maintenance);
+    printf("VGIC|INFO: longest IRQ queue: %lu (of %d)\n", stats->max_queue_len, MAX_IRQ_QUEUE_LEN);
+#endif
+}
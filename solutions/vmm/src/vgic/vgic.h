@@ -8,6 +8,7 @@
 #include <microkit.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include "../fault.h"
 
 // @ivanv: this should all come from the DTS!
 #if defined(BOARD_qemu_virt_aarch64)
@@ -42,6 +43,8 @@
 /* Uncomment these defines for more verbose logging in the GIC driver. */
 // #define DEBUG_IRQ
 // #define DEBUG_DIST
+/* Uncomment this define to count what the GIC driver does, see vgic_print_stats(). */
+// #define DEBUG_VGIC_STATS
 
 #if defined(DEBUG_IRQ)
 #define LOG_IRQ(...) do{ printf("VGIC|IRQ: "); printf(__VA_ARGS__); }while(0)
@@ -55,11 +58,21 @@
 #define LOG_DIST(...) do{}while(0)
 #endif
 
+#if defined(DEBUG_VGIC_STATS)
+#define VGIC_STAT_INC(vgic, stat) do{ (vgic)->stats.stat++; }while(0)
+#define VGIC_STAT_MAX(vgic, stat, val) do{ if ((val) > (vgic)->stats.stat) { (vgic)->stats.stat = (val); } }while(0)
+#else
+#define VGIC_STAT_INC(vgic, stat) do{}while(0)
+#define VGIC_STAT_MAX(vgic, stat, val) do{}while(0)
+#endif
+
 typedef void (*irq_ack_fn_t)(uint64_t vcpu_id, int irq, void *cookie);
 
 void vgic_init();
 bool handle_vgic_maintenance(uint64_t vcpu_id);
-bool handle_vgic_dist_fault(uint64_t vcpu_id, uint64_t fault_addr, uint64_t fsr, seL4_UserContext *regs);
-bool handle_vgic_redist_fault(uint64_t vcpu_id, uint64_t fault_addr, uint64_t fsr, seL4_UserContext *regs);
+bool handle_vgic_dist_fault(uint64_t vcpu_id, uint64_t fault_addr, uint64_t fsr, struct fault_ctx *ctx);
+bool handle_vgic_redist_fault(uint64_t vcpu_id, uint64_t fault_addr, uint64_t fsr, struct fault_ctx *ctx);
 bool vgic_register_irq(uint64_t vcpu_id, int virq_num, irq_ack_fn_t ack_fn, void *ack_data);
 bool vgic_inject_irq(uint64_t vcpu_id, int irq);
+bool vgic_irq_is_edge_triggered(int irq);
+void vgic_print_stats(void);
@@ -46,9 +46,9 @@
 
 vgic_t vgic;
 
-static bool handle_vgic_redist_read_fault(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset, uint64_t fsr, seL4_UserContext *regs)
+static bool handle_vgic_redist_read_fault(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset, uint64_t fsr, struct fault_ctx *ctx)
 {
-    int err = 0;
+    bool success;
     struct gic_dist_map *gic_dist = vgic_get_dist(vgic->registers);
     struct gic_redist_map *gic_redist = vgic_get_redist(vgic->registers);
     uint32_t reg = 0;
@@ -85,20 +85,20 @@ static bool handle_vgic_redist_read_fault(uint64_t vcpu_id, vgic_t *vgic, uint64
     default:
         LOG_VMM_ERR("Unknown register offset 0x%x\n", offset);
         // @ivanv: used to be ignore_fault, double check this is right
-        success = fault_advance_vcpu(regs);
+        success = fault_advance_vcpu(ctx);
         goto fault_return;
     }
 
     uintptr_t fault_addr = GIC_REDIST_PADDR + offset;
     uint32_t mask = fault_get_data_mask(fault_addr, fsr);
-    success = fault_advance(regs, fault_addr, fsr, reg & mask);
+    success = fault_advance(ctx, fault_addr, fsr, reg & mask);
 
 fault_return:
     return success;
 }
 
 
-static bool handle_vgic_redist_write_fault(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset, uint64_t fsr, seL4_UserContext *regs)
+static bool handle_vgic_redist_write_fault(uint64_t vcpu_id, vgic_t *vgic, uint64_t offset, uint64_t fsr, struct fault_ctx *ctx)
 {
     // @ivanv: why is this not reading from the redist?
     uintptr_t fault_addr = GIC_REDIST_PADDR + offset;
@@ -110,10 +110,10 @@ static bool handle_vgic_redist_write_fault(uint64_t vcpu_id, vgic_t *vgic, uint6
         /* Writes are ignored */
         break;
     case RANGE32(GICR_IGROUPR0, GICR_IGROUPR0):
-        emulate_reg_write_access(regs, fault_addr, fsr, &gic_dist->irq_group0[vcpu_id]);
+        emulate_reg_write_access(ctx, fault_addr, fsr, &gic_dist->irq_group0[vcpu_id]);
         break;
     case RANGE32(GICR_ISENABLER0, GICR_ISENABLER0):
-        data = fault_get_data(regs, fsr);
+        data = fault_get_data(ctx, fsr);
         /* Mask the data to write */
         data &= mask;
         while (data) {
@@ -124,7 +124,7 @@ static bool handle_vgic_redist_write_fault(uint64_t vcpu_id, vgic_t *vgic, uint6
         }
         break;
     case RANGE32(GICR_ICENABLER0, GICR_ICENABLER0):
-        data = fault_get_data(regs, fsr);
+        data = fault_get_data(ctx, fsr);
         /* Mask the data to write */
         data &= mask;
         while (data) {
@@ -137,32 +137,34 @@ static bool handle_vgic_redist_write_fault(uint64_t vcpu_id, vgic_t *vgic, uint6
     case RANGE32(GICR_ICACTIVER0, GICR_ICACTIVER0):
     // @ivanv: understand, this is a comment left over from kent
     // TODO fix this
-        emulate_reg_write_access(regs, fault_addr, fsr, &gic_dist->active0[vcpu_id]);
+        emulate_reg_write_access(ctx, fault_addr, fsr, &gic_dist->active0[vcpu_id]);
         break;
-    case RANGE32(GICR_IPRIORITYR0, GICR_IPRIORITYRN):
+    case RANGE32(GICR_IPRIORITYR0, GICR_IPRIORITYRN): {
+        /* The SGI and PPI priorities are kept per vCPU in the distributor, as with GICv2 */
+        uint64_t reg_offset = GIC_DIST_REGN(offset, GICR_IPRIORITYR0);
+        emulate_reg_write_access(ctx, fault_addr, fsr, &gic_dist->priority0[vcpu_id][reg_offset]);
+        gic_dist->priority0[vcpu_id][reg_offset] &= GIC_DIST_PRIORITY_MASK;
         break;
+    }
     default:
-        LOG_VMM_ERR("Unknown register offset 0x%x, value: 0x%x\n", offset, fault_get_data(regs, fsr));
+        LOG_VMM_ERR("Unknown register offset 0x%x, value: 0x%x\n", offset, fault_get_data(ctx, fsr));
     }
 
-    int err = fault_advance_vcpu(regs);
-    assert(!err);
-    if (err) {
-        return false;
-    }
+    bool success = fault_advance_vcpu(ctx);
+    assert(success);
 
-    return true;
+    return success;
 }
 
-bool handle_vgic_redist_fault(uint64_t vcpu_id, uint64_t fault_addr, uint64_t fsr, seL4_UserContext *regs) {
+bool handle_vgic_redist_fault(uint64_t vcpu_id, uint64_t fault_addr, uint64_t fsr, struct fault_ctx *ctx) {
     assert(fault_addr >= GIC_REDIST_PADDR);
     uint64_t offset = fault_addr - GIC_REDIST_PADDR;
     assert(offset < GIC_REDIST_SIZE);
 
     if (fault_is_read(fsr)) {
-        return handle_vgic_redist_read_fault(vcpu_id, &vgic, offset, fsr, regs);
+        return handle_vgic_redist_read_fault(vcpu_id, &vgic, offset, fsr, ctx);
     } else {
-        return handle_vgic_redist_write_fault(vcpu_id, &vgic, offset, fsr, regs);
+        return handle_vgic_redist_write_fault(vcpu_id, &vgic, offset, fsr, ctx);
     }
 }
 
@@ -217,11 +219,19 @@ void vgic_init()
     for (int i = 0; i < NUM_SLOTS_SPI_VIRQ; i++) {
         vgic.vspis[i].virq = VIRQ_INVALID;
     }
-    for (int i = 0; i < NUM_VCPU_LOCAL_VIRQS; i++) {
-        vgic.vgic_vcpu[VCPU_ID].local_virqs[i].virq = VIRQ_INVALID;
+    for (int i = 0; i < NUM_SPI_VIRQS; i++) {
+        vgic.vspi_slots[i] = VIRQ_SPI_SLOT_INVALID;
     }
-    for (int i = 0; i < NUM_LIST_REGS; i++) {
-        vgic.vgic_vcpu[VCPU_ID].lr_shadow[i].virq = VIRQ_INVALID;
+    vgic.num_vspis = 0;
+    vgic.num_list_regs = vgic_probe_num_list_regs();
+    for (int vcpu = 0; vcpu < GUEST_NUM_VCPUS; vcpu++) {
+        for (int i = 0; i < NUM_VCPU_LOCAL_VIRQS; i++) {
+            vgic.vgic_vcpu[vcpu].local_virqs[i].virq = VIRQ_INVALID;
+        }
+        for (int i = 0; i < NUM_LIST_REGS; i++) {
+            vgic.vgic_vcpu[vcpu].lr_shadow[i].virq = VIRQ_INVALID;
+        }
+        vgic_irq_queue_init(&vgic.vgic_vcpu[vcpu].irq_queue);
     }
     vgic.registers = &vgic_regs;
     vgic_regs.dist = &dist;
@@ -179,6 +179,10 @@ struct gic_redist_map {          /* Starting */
 #define GIC_DIST_IROUTER0      0x6100
 #define GIC_DIST_IROUTERN      0x7FD8
 
+/* Interrupt Routing Mode, when set the SPI can go to any PE */
+#define GIC_DIST_IROUTER_IRM    (1U << 31)
+#define GIC_DIST_IROUTER_AFF0   0xff
+
 /*
  * ARM Generic Interrupt Controller (Architecture version 3.0)
  * Architecture Specification (Issue C)
@@ -21,6 +21,7 @@
 #define NUM_SGI_VIRQS           16   // vCPU local SGI interrupts
 #define NUM_PPI_VIRQS           16   // vCPU local PPI interrupts
 #define NUM_VCPU_LOCAL_VIRQS    (NUM_SGI_VIRQS + NUM_PPI_VIRQS)
+#define NUM_SPI_VIRQS           988  // global SPI interrupts (32 - 1019)
 
 /* Usually, VMs do not use all SPIs. To reduce the memory footprint, our vGIC
  * implementation manages the SPIs in a fixed size slot list. 200 entries have
@@ -28,6 +29,15 @@
  */
 #define NUM_SLOTS_SPI_VIRQ      200
 
+/* To find the slot of an SPI without searching through the slot list, we keep
+ * a table indexed by SPI that holds the slot number. A byte per SPI keeps the
+ * table small, so the slot list is still what saves the memory.
+ */
+#define VIRQ_SPI_SLOT_INVALID   0xff
+
+static_assert(NUM_SLOTS_SPI_VIRQ < VIRQ_SPI_SLOT_INVALID,
+              "SPI slot numbers must fit in the SPI slot table");
+
 #define VIRQ_INVALID -1
 
 typedef void (*irq_ack_fn_t)(uint64_t vcpu_id, int irq, void *cookie);
@@ -46,25 +56,54 @@ static inline void virq_ack(uint64_t vcpu_id, struct virq_handle *irq)
     irq->ack_fn(vcpu_id, irq->virq, irq->ack_data);
 }
 
-/* TODO: A typical number of list registers supported by GIC is four, but not
- * always. One particular way to probe the number of registers is to inject a
- * dummy IRQ with seL4_ARM_VCPU_InjectIRQ(), using LR index high enough to be
- * not supported by any target; the kernel will reply with the supported range
- * of LR indexes.
+/* A typical number of list registers supported by GIC is four, but not
+ * always, the architecture allows up to 16. We keep room for the maximum and
+ * probe how many there actually are when initialising the vGIC (see
+ * vgic_probe_num_list_regs).
  */
-#define NUM_LIST_REGS 4
+#define NUM_LIST_REGS 16
+/* What we assume if probing fails */
+#define NUM_LIST_REGS_DEFAULT 4
 /* This is a rather arbitrary number, increase if needed. */
 #define MAX_IRQ_QUEUE_LEN 64
-#define IRQ_QUEUE_NEXT(_i) (((_i) + 1) & (MAX_IRQ_QUEUE_LEN - 1))
 
-static_assert((MAX_IRQ_QUEUE_LEN & (MAX_IRQ_QUEUE_LEN - 1)) == 0,
-              "IRQ ring buffer size must be power of two");
+/* The GIC priority of an IRQ is 8 bits, with lower values being higher
+ * priority. The virtual CPU interface only implements the top 5 bits, so
+ * that is all our distributor keeps as well, giving 32 priority levels.
+ */
+#define NUM_IRQ_PRIORITIES      32
+#define IRQ_PRIORITY_SHIFT      3
+#define IRQ_PRIORITY_LEVEL(p)   ((p) >> IRQ_PRIORITY_SHIFT)
+
+#define IRQ_QUEUE_NONE 0xff
+
+static_assert(MAX_IRQ_QUEUE_LEN < IRQ_QUEUE_NONE,
+              "IRQ queue indexes must fit in a byte");
+static_assert(NUM_IRQ_PRIORITIES <= 32,
+              "IRQ queue levels must fit in a 32-bit bitmap");
 
-// @ivanv: make a note of all datastructure invariants
+struct irq_queue_entry {
+    struct virq_handle *virq;
+    uint8_t priority;
+    uint8_t next;
+};
+
+/* The IRQs that don't fit in the list registers, ordered by priority. Each
+ * priority level has its own FIFO list of entries so that IRQs of the same
+ * priority are delivered in the order they arrived. The bitmap of levels
+ * that have IRQs queued lets us find the highest priority IRQ without
+ * looking at every level.
+ */
 struct irq_queue {
-    struct virq_handle *irqs[MAX_IRQ_QUEUE_LEN]; /* circular buffer */
-    uint64_t head;
-    uint64_t tail;
+    struct irq_queue_entry entries[MAX_IRQ_QUEUE_LEN];
+    /* list of unused entries */
+    uint8_t free;
+    uint8_t head[NUM_IRQ_PRIORITIES];
+    uint8_t tail[NUM_IRQ_PRIORITIES];
+    /* bit n is set when there are IRQs queued at priority level n */
+    uint32_t levels;
+    /* number of IRQs queued */
+    uint8_t len;
 };
 
 /* vCPU specific interrupt context */
@@ -75,16 +114,48 @@ typedef struct vgic_vcpu {
     struct irq_queue irq_queue;
     /*  vCPU local interrupts (SGI, PPI) */
     struct virq_handle local_virqs[NUM_VCPU_LOCAL_VIRQS];
+    /* Edge-triggered local interrupts that arrived again while still pending or active */
+    uint32_t local_latched;
 } vgic_vcpu_t;
 
+#if defined(DEBUG_VGIC_STATS)
+struct vgic_stats {
+    /* guest accesses to the distributor */
+    uint64_t dist_reads;
+    uint64_t dist_writes;
+    /* IRQs made pending, and those that could not be because they were disabled */
+    uint64_t injected;
+    uint64_t dropped;
+    /* edges that arrived while the IRQ was still pending or active */
+    uint64_t latched;
+    /* pending IRQs that went straight into a list register or had to wait in the queue */
+    uint64_t loaded;
+    uint64_t queued;
+    uint64_t maintenance;
+    /* the most IRQs ever waiting in any vCPU's queue */
+    uint64_t max_queue_len;
+};
+#endif
+
 /* GIC global interrupt context */
 typedef struct vgic {
     /* virtual registers */
     void *registers;
     /* registered global interrupts (SPI) */
     struct virq_handle vspis[NUM_SLOTS_SPI_VIRQ];
+    /* slot in vspis of each SPI, VIRQ_SPI_SLOT_INVALID if not registered */
+    uint8_t vspi_slots[NUM_SPI_VIRQS];
+    /* number of slots in vspis that are in use */
+    int num_vspis;
+    /* Edge-triggered SPIs that arrived again while still pending or active */
+    uint32_t spi_latched[(NUM_SPI_VIRQS + 31) / 32];
     /* vCPU specific interrupt context */
     vgic_vcpu_t vgic_vcpu[GUEST_NUM_VCPUS];
+    /* number of list registers the hardware has, at most NUM_LIST_REGS */
+    int num_list_regs;
+#if defined(DEBUG_VGIC_STATS)
+    struct vgic_stats stats;
+#endif
 } vgic_t;
 
 static inline vgic_vcpu_t *get_vgic_vcpu(vgic_t *vgic, int vcpu_id)
@@ -104,12 +175,15 @@ static inline struct virq_handle *virq_get_sgi_ppi(vgic_t *vgic, uint64_t vcpu_i
 
 static inline struct virq_handle *virq_find_spi_irq_data(struct vgic *vgic, int virq)
 {
-    for (int i = 0; i < ARRAY_SIZE(vgic->vspis); i++) {
-        if (vgic->vspis[i].virq != VIRQ_INVALID && vgic->vspis[i].virq == virq) {
-            return &vgic->vspis[i];
-        }
+    int spi = virq - NUM_VCPU_LOCAL_VIRQS;
+    if (spi < 0 || spi >= NUM_SPI_VIRQS) {
+        return NULL;
+    }
+    uint8_t slot = vgic->vspi_slots[spi];
+    if (slot == VIRQ_SPI_SLOT_INVALID) {
+        return NULL;
     }
-    return NULL;
+    return &vgic->vspis[slot];
 }
 
 static inline struct virq_handle *virq_find_irq_data(struct vgic *vgic, uint64_t vcpu_id, int virq)
@@ -122,15 +196,26 @@ static inline struct virq_handle *virq_find_irq_data(struct vgic *vgic, uint64_t
 
 static inline bool virq_spi_add(vgic_t *vgic, struct virq_handle *virq_data)
 {
-    for (int i = 0; i < ARRAY_SIZE(vgic->vspis); i++) {
-        if (vgic->vspis[i].virq == VIRQ_INVALID) {
-            vgic->vspis[i] = *virq_data;
-            return true;
-        }
+    int spi = virq_data->virq - NUM_VCPU_LOCAL_VIRQS;
+    if (spi < 0 || spi >= NUM_SPI_VIRQS) {
+        LOG_VMM_ERR("Could not add SPI IRQ (0x%lx), not a valid SPI.\n", virq_data->virq);
+        return false;
+    }
+    if (vgic->vspi_slots[spi] != VIRQ_SPI_SLOT_INVALID) {
+        LOG_VMM_ERR("SPI IRQ %d already registered\n", virq_data->virq);
+        return false;
+    }
+    /* Slots are never freed, so the next free slot is always the one after the last used one */
+    if (vgic->num_vspis == ARRAY_SIZE(vgic->vspis)) {
+        LOG_VMM_ERR("Could not add SPI IRQ (0x%lx), ran out of slots.\n", virq_data->virq);
+        return false;
     }
 
-    LOG_VMM_ERR("Could not add SPI IRQ (0x%lx), ran out of slots.\n", virq_data->virq);
-    return false;
+    int slot = vgic->num_vspis++;
+    vgic->vspis[slot] = *virq_data;
+    vgic->vspi_slots[spi] = slot;
+
+    return true;
 }
 
 static inline bool virq_sgi_ppi_add(uint64_t vcpu_id, vgic_t *vgic, struct virq_handle *virq_data)
@@ -157,34 +242,79 @@ static inline bool virq_add(uint64_t vcpu_id, vgic_t *vgic, struct virq_handle *
     return virq_spi_add(vgic, virq_handle);
 }
 
-static inline bool vgic_irq_enqueue(vgic_t *vgic, uint64_t vcpu_id, struct virq_handle *irq)
+static inline void vgic_irq_queue_init(struct irq_queue *q)
+{
+    for (int i = 0; i < MAX_IRQ_QUEUE_LEN; i++) {
+        q->entries[i].virq = NULL;
+        q->entries[i].next = (i + 1 < MAX_IRQ_QUEUE_LEN) ? i + 1 : IRQ_QUEUE_NONE;
+    }
+    q->free = 0;
+    for (int i = 0; i < NUM_IRQ_PRIORITIES; i++) {
+        q->head[i] = IRQ_QUEUE_NONE;
+        q->tail[i] = IRQ_QUEUE_NONE;
+    }
+    q->levels = 0;
+    q->len = 0;
+}
+
+static inline bool vgic_irq_enqueue(vgic_t *vgic, uint64_t vcpu_id, struct virq_handle *irq, uint8_t priority)
 {
     vgic_vcpu_t *vgic_vcpu = get_vgic_vcpu(vgic, vcpu_id);
     assert(vgic_vcpu);
     struct irq_queue *q = &vgic_vcpu->irq_queue;
 
     // @ivanv: add "unlikely" call
-    if (IRQ_QUEUE_NEXT(q->tail) == q->head) {
+    if (q->free == IRQ_QUEUE_NONE) {
         return false;
     }
 
-    q->irqs[q->tail] = irq;
-    q->tail = IRQ_QUEUE_NEXT(q->tail);
+    uint8_t idx = q->free;
+    struct irq_queue_entry *entry = &q->entries[idx];
+    q->free = entry->next;
+    entry->virq = irq;
+    entry->priority = priority;
+    entry->next = IRQ_QUEUE_NONE;
+
+    int level = IRQ_PRIORITY_LEVEL(priority);
+    if (q->tail[level] == IRQ_QUEUE_NONE) {
+        q->head[level] = idx;
+    } else {
+        q->entries[q->tail[level]].next = idx;
+    }
+    q->tail[level] = idx;
+    q->levels |= (1U << level);
+    q->len++;
+    VGIC_STAT_MAX(vgic, max_queue_len, q->len);
 
     return true;
 }
 
-static inline struct virq_handle *vgic_irq_dequeue(vgic_t *vgic, uint64_t vcpu_id)
+static inline struct virq_handle *vgic_irq_dequeue(vgic_t *vgic, uint64_t vcpu_id, uint8_t *priority)
 {
     vgic_vcpu_t *vgic_vcpu = get_vgic_vcpu(vgic, vcpu_id);
     assert(vgic_vcpu);
     struct irq_queue *q = &vgic_vcpu->irq_queue;
-    struct virq_handle *virq = NULL;
 
-    if (q->head != q->tail) {
-        virq = q->irqs[q->head];
-        q->head = IRQ_QUEUE_NEXT(q->head);
+    if (q->levels == 0) {
+        return NULL;
+    }
+
+    /* Lower levels are higher priority */
+    int level = CTZ(q->levels);
+    uint8_t idx = q->head[level];
+    struct irq_queue_entry *entry = &q->entries[idx];
+    struct virq_handle *virq = entry->virq;
+    *priority = entry->priority;
+
+    q->head[level] = entry->next;
+    if (q->head[level] == IRQ_QUEUE_NONE) {
+        q->tail[level] = IRQ_QUEUE_NONE;
+        q->levels &= ~(1U << level);
     }
+    entry->virq = NULL;
+    entry->next = q->free;
+    q->free = idx;
+    q->len--;
 
     return virq;
 }
@@ -193,7 +323,7 @@ static inline int vgic_find_empty_list_reg(vgic_t *vgic, uint64_t vcpu_id)
 {
     vgic_vcpu_t *vgic_vcpu = get_vgic_vcpu(vgic, vcpu_id);
     assert(vgic_vcpu);
-    for (int i = 0; i < ARRAY_SIZE(vgic_vcpu->lr_shadow); i++) {
+    for (int i = 0; i < vgic->num_list_regs; i++) {
         if (vgic_vcpu->lr_shadow[i].virq == VIRQ_INVALID) {
             return i;
         }
@@ -202,14 +332,43 @@ static inline int vgic_find_empty_list_reg(vgic_t *vgic, uint64_t vcpu_id)
     return -1;
 }
 
-static inline bool vgic_vcpu_load_list_reg(vgic_t *vgic, uint64_t vcpu_id, int idx, int group, struct virq_handle *virq)
+/*
+ * Load an IRQ into a list register. This fails if the list register holds an
+ * IRQ the guest has already started handling, the kernel will not overwrite an
+ * active list register.
+ */
+static inline bool vgic_vcpu_load_list_reg(vgic_t *vgic, uint64_t vcpu_id, int idx, int group, struct virq_handle *virq, uint8_t priority)
 {
     vgic_vcpu_t *vgic_vcpu = get_vgic_vcpu(vgic, vcpu_id);
     assert(vgic_vcpu);
-    assert((idx >= 0) && (idx < ARRAY_SIZE(vgic_vcpu->lr_shadow)));
-    // @ivanv: why is the priority 0?
-    microkit_vcpu_arm_inject_irq(GUEST_ID, virq->virq, 0, group, idx);
+    assert((idx >= 0) && (idx < vgic->num_list_regs));
+    seL4_Error err = seL4_ARM_VCPU_InjectIRQ(BASE_VCPU_CAP + vcpu_id, virq->virq, IRQ_PRIORITY_LEVEL(priority), group, idx);
+    if (err != seL4_NoError) {
+        return false;
+    }
     vgic_vcpu->lr_shadow[idx] = *virq;
 
     return true;
 }
+
+/*
+ * Find out how many list registers the GIC has by injecting a dummy IRQ into a
+ * list register that no GIC has. The kernel rejects it with a range error
+ * that tells us the valid list register indexes.
+ */
+static inline int vgic_probe_num_list_regs(void)
+{
+    seL4_Error err = seL4_ARM_VCPU_InjectIRQ(BASE_VCPU_CAP + GUEST_BOOT_VCPU_ID, 0, 0, 0, 0xff);
+    if (err != seL4_RangeError) {
+        LOG_VMM_ERR("Could not probe number of list registers (error %d), assuming %d\n", err, NUM_LIST_REGS_DEFAULT);
+        return NUM_LIST_REGS_DEFAULT;
+    }
+    /* The range error holds the lowest and highest valid index */
+    int num_list_regs = seL4_GetMR(1) + 1;
+    if (num_list_regs > NUM_LIST_REGS) {
+        LOG_VMM_ERR("GIC has %d list registers, only using %d\n", num_list_regs, NUM_LIST_REGS);
+        num_list_regs = NUM_LIST_REGS;
+    }
+
+    return num_list_regs;
+}
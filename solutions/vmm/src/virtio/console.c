@@ -0,0 +1,86 @@
+/*
+ * Copyright 2023, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * A minimal virtIO console with a single port. Only the transmit queue does
+ * anything, all the output of the guest is handed to the VMM through the
+ * output callback. We never have any input for the guest so the buffers it
+ * puts in the receive queue are left there.
+ */
+
+#include <microkit.h>
+#include "console.h"
+#include "../util/util.h"
+
+static void virtio_console_handle_tx(struct virtio_console *console)
+{
+    struct virtio_queue *vq = &console->dev.queues[VIRTIO_CONSOLE_TX_QUEUE];
+    bool used = false;
+    uint16_t desc_head;
+    while (virtio_queue_pop(vq, &desc_head)) {
+        uint16_t idx = desc_head;
+        /* Bound the chain length so a malicious guest cannot make us loop */
+        for (uint32_t i = 0; i < vq->num; i++) {
+            struct virtq_desc *desc = virtio_queue_desc(vq, idx);
+            if (!desc) {
+                break;
+            }
+            if (!(desc->flags & VIRTQ_DESC_F_WRITE)) {
+                char *buf = virtio_guest_to_vmm(desc->addr, desc->len);
+                if (buf && console->output) {
+                    console->output(buf, desc->len);
+                }
+            }
+            if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+                break;
+            }
+            idx = desc->next;
+        }
+        /* Nothing is written into transmit buffers, hence the length of 0. */
+        virtio_queue_push_used(vq, desc_head, 0);
+        used = true;
+    }
+
+    /* One interrupt for the whole batch rather than one per buffer. */
+    if (used && !virtio_device_notify_used(&console->dev)) {
+        LOG_VMM_ERR("could not inject virtIO console IRQ\n");
+    }
+}
+
+static void virtio_console_queue_notify(struct virtio_device *dev, uint32_t queue)
+{
+    struct virtio_console *console = dev->data;
+    switch (queue) {
+    case VIRTIO_CONSOLE_TX_QUEUE:
+        virtio_console_handle_tx(console);
+        break;
+    case VIRTIO_CONSOLE_RX_QUEUE:
+        /* We have nothing to give the guest */
+        break;
+    }
+}
+
+bool virtio_console_init(struct virtio_console *console, uint64_t vcpu_id, int virq, virtio_console_output_fn_t output)
+{
+    /* We are also called when the guest restarts, so start from scratch */
+    memset(console, 0, sizeof(*console));
+    console->config.cols = 80;
+    console->config.rows = 24;
+    console->config.max_nr_ports = 1;
+    console->config.emerg_wr = 0;
+    console->output = output;
+
+    struct virtio_device *dev = &console->dev;
+    dev->device_id = VIRTIO_ID_CONSOLE;
+    dev->features = (1ULL << VIRTIO_F_VERSION_1);
+    dev->num_queues = VIRTIO_CONSOLE_NUM_QUEUES;
+    dev->config = &console->config;
+    dev->config_size = sizeof(console->config);
+    dev->queue_notify = &virtio_console_queue_notify;
+    dev->data = console;
+
+    return virtio_mmio_register_device(dev, vcpu_id, virq);
+}
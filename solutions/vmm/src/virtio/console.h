@@ -0,0 +1,36 @@
+/*
+ * Copyright 2023, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mmio.h"
+
+/* Section 5.3: Console Device */
+#define VIRTIO_ID_CONSOLE       3
+
+#define VIRTIO_CONSOLE_RX_QUEUE 0
+#define VIRTIO_CONSOLE_TX_QUEUE 1
+#define VIRTIO_CONSOLE_NUM_QUEUES 2
+
+struct virtio_console_config {
+    uint16_t cols;
+    uint16_t rows;
+    uint32_t max_nr_ports;
+    uint32_t emerg_wr;
+};
+
+/* Called with everything the guest writes to the console. */
+typedef void (*virtio_console_output_fn_t)(char *buf, uint32_t len);
+
+struct virtio_console {
+    struct virtio_device dev;
+    struct virtio_console_config config;
+    virtio_console_output_fn_t output;
+};
+
+bool virtio_console_init(struct virtio_console *console, uint64_t vcpu_id, int virq, virtio_console_output_fn_t output);
@@ -0,0 +1,284 @@
+/*
+ * Copyright 2023, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * This file emulates the virtIO MMIO transport, which is how the guest finds
+ * out about a device and sets up its virtqueues. The virtqueues themselves live
+ * in guest RAM, so once they are set up the only accesses that trap into the
+ * VMM are the guest notifying us of new buffers (one register write per batch
+ * of buffers) and the guest acknowledging our interrupts.
+ */
+
+#include <stddef.h>
+#include <microkit.h>
+#include "mmio.h"
+#include "../util/util.h"
+#include "../fault.h"
+#include "../vgic/vgic.h"
+#include "../vmm.h"
+
+#define RANGE32(a, b) a ... b + (sizeof(uint32_t)-1)
+
+/* Microkit will set this variable to the start of the guest RAM memory region. */
+extern uintptr_t guest_ram_vaddr;
+
+/* The device does not need to know when the guest has handled its IRQ. */
+static void virtio_virq_ack(uint64_t vcpu_id, int irq, void *cookie) {}
+
+bool virtio_mmio_register_device(struct virtio_device *dev, uint64_t vcpu_id, int virq)
+{
+    assert(dev->num_queues <= VIRTIO_MMIO_MAX_QUEUES);
+    dev->vcpu_id = vcpu_id;
+    dev->virq = virq;
+
+    return vgic_register_irq(vcpu_id, virq, &virtio_virq_ack, dev);
+}
+
+static void virtio_mmio_reset(struct virtio_device *dev)
+{
+    dev->driver_features = 0;
+    dev->device_features_sel = 0;
+    dev->driver_features_sel = 0;
+    dev->queue_sel = 0;
+    dev->status = 0;
+    dev->interrupt_status = 0;
+    memset(dev->queues, 0, sizeof(dev->queues));
+}
+
+/*
+ * The guest RAM is mapped into the VMM at the same address it is at in the
+ * guest's physical address space, so all we need to do is make sure that the
+ * guest is not pointing us somewhere outside of its RAM.
+ */
+void *virtio_guest_to_vmm(uint64_t guest_addr, uint64_t len)
+{
+    if (guest_addr < guest_ram_vaddr || guest_addr + len < guest_addr ||
+        guest_addr + len > guest_ram_vaddr + GUEST_RAM_SIZE) {
+        LOG_VMM_ERR("virtIO buffer 0x%lx (0x%lx bytes) is outside of guest RAM\n", guest_addr, len);
+        return NULL;
+    }
+
+    return (void *)guest_addr;
+}
+
+/* Get the head of the next descriptor chain the guest has made available. */
+bool virtio_queue_pop(struct virtio_queue *vq, uint16_t *desc_head)
+{
+    if (!vq->ready) {
+        return false;
+    }
+    struct virtq_avail *avail = virtio_guest_to_vmm(vq->avail_addr, sizeof(struct virtq_avail) + vq->num * sizeof(uint16_t));
+    if (!avail) {
+        return false;
+    }
+    uint16_t avail_idx = __atomic_load_n(&avail->idx, __ATOMIC_ACQUIRE);
+    if (vq->last_avail_idx == avail_idx) {
+        return false;
+    }
+    *desc_head = avail->ring[vq->last_avail_idx % vq->num];
+    vq->last_avail_idx++;
+
+    return true;
+}
+
+struct virtq_desc *virtio_queue_desc(struct virtio_queue *vq, uint16_t idx)
+{
+    if (idx >= vq->num) {
+        LOG_VMM_ERR("virtIO descriptor index %d out of range\n", idx);
+        return NULL;
+    }
+    struct virtq_desc *desc = virtio_guest_to_vmm(vq->desc_addr, vq->num * sizeof(struct virtq_desc));
+    if (!desc) {
+        return NULL;
+    }
+
+    return &desc[idx];
+}
+
+void virtio_queue_push_used(struct virtio_queue *vq, uint16_t desc_head, uint32_t len)
+{
+    struct virtq_used *used = virtio_guest_to_vmm(vq->used_addr, sizeof(struct virtq_used) + vq->num * sizeof(struct virtq_used_elem));
+    if (!used) {
+        return;
+    }
+    uint16_t used_idx = used->idx;
+    used->ring[used_idx % vq->num].id = desc_head;
+    used->ring[used_idx % vq->num].len = len;
+    /* The guest must see the element before it sees the new index. */
+    __atomic_store_n(&used->idx, used_idx + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Tell the guest that we have put buffers in the used ring. Devices should
+ * call this once after processing a batch of buffers rather than for each one.
+ */
+bool virtio_device_notify_used(struct virtio_device *dev)
+{
+    dev->interrupt_status |= VIRTIO_MMIO_INT_VRING;
+    return vgic_inject_irq(dev->vcpu_id, dev->virq);
+}
+
+static struct virtio_queue *virtio_mmio_selected_queue(struct virtio_device *dev)
+{
+    if (dev->queue_sel >= dev->num_queues) {
+        return NULL;
+    }
+    return &dev->queues[dev->queue_sel];
+}
+
+static bool virtio_mmio_reg_read(struct virtio_device *dev, uint64_t offset, uint64_t fault_addr, uint64_t fsr, struct fault_ctx *ctx)
+{
+    uint32_t reg = 0;
+    struct virtio_queue *vq = virtio_mmio_selected_queue(dev);
+    switch (offset) {
+    case RANGE32(VIRTIO_MMIO_MAGIC_VALUE, VIRTIO_MMIO_MAGIC_VALUE):
+        reg = VIRTIO_MMIO_MAGIC;
+        break;
+    case RANGE32(VIRTIO_MMIO_VERSION, VIRTIO_MMIO_VERSION):
+        reg = VIRTIO_MMIO_DEV_VERSION;
+        break;
+    case RANGE32(VIRTIO_MMIO_DEVICE_ID, VIRTIO_MMIO_DEVICE_ID):
+        reg = dev->device_id;
+        break;
+    case RANGE32(VIRTIO_MMIO_VENDOR_ID, VIRTIO_MMIO_VENDOR_ID):
+        reg = VIRTIO_MMIO_DEV_VENDOR_ID;
+        break;
+    case RANGE32(VIRTIO_MMIO_DEVICE_FEATURES, VIRTIO_MMIO_DEVICE_FEATURES):
+        if (dev->device_features_sel == 0) {
+            reg = dev->features & 0xffffffff;
+        } else if (dev->device_features_sel == 1) {
+            reg = dev->features >> 32;
+        }
+        break;
+    case RANGE32(VIRTIO_MMIO_QUEUE_NUM_MAX, VIRTIO_MMIO_QUEUE_NUM_MAX):
+        /* Zero tells the driver that the selected queue does not exist */
+        reg = vq ? VIRTIO_QUEUE_NUM_MAX : 0;
+        break;
+    case RANGE32(VIRTIO_MMIO_QUEUE_READY, VIRTIO_MMIO_QUEUE_READY):
+        reg = vq ? vq->ready : 0;
+        break;
+    case RANGE32(VIRTIO_MMIO_INTERRUPT_STATUS, VIRTIO_MMIO_INTERRUPT_STATUS):
+        reg = dev->interrupt_status;
+        break;
+    case RANGE32(VIRTIO_MMIO_STATUS, VIRTIO_MMIO_STATUS):
+        reg = dev->status;
+        break;
+    case RANGE32(VIRTIO_MMIO_CONFIG_GENERATION, VIRTIO_MMIO_CONFIG_GENERATION):
+        /* Our configuration space never changes */
+        reg = 0;
+        break;
+    default:
+        if (offset >= VIRTIO_MMIO_CONFIG && offset < VIRTIO_MMIO_CONFIG + dev->config_size) {
+            /* Let fault_advance deal with accesses narrower than a word */
+            uint64_t config_offset = (offset - VIRTIO_MMIO_CONFIG) & ~0x3;
+            uint8_t *config = (uint8_t *)dev->config + config_offset;
+            for (int i = 0; i < sizeof(uint32_t) && config_offset + i < dev->config_size; i++) {
+                reg |= (uint32_t)config[i] << (i * 8);
+            }
+            break;
+        }
+        LOG_VMM_ERR("virtIO read from unknown register offset 0x%lx\n", offset);
+        break;
+    }
+
+    uint32_t mask = fault_get_data_mask(fault_addr, fsr);
+    return fault_advance(ctx, fault_addr, fsr, reg & mask);
+}
+
+static bool virtio_mmio_reg_write(struct virtio_device *dev, uint64_t offset, uint64_t fault_addr, uint64_t fsr, struct fault_ctx *ctx)
+{
+    uint32_t data = fault_get_data(ctx, fsr) & fault_get_data_mask(fault_addr, fsr);
+    struct virtio_queue *vq = virtio_mmio_selected_queue(dev);
+    switch (offset) {
+    case RANGE32(VIRTIO_MMIO_DEVICE_FEATURES_SEL, VIRTIO_MMIO_DEVICE_FEATURES_SEL):
+        dev->device_features_sel = data;
+        break;
+    case RANGE32(VIRTIO_MMIO_DRIVER_FEATURES, VIRTIO_MMIO_DRIVER_FEATURES):
+        if (dev->driver_features_sel == 0) {
+            dev->driver_features = (dev->driver_features & ~0xffffffffULL) | data;
+        } else if (dev->driver_features_sel == 1) {
+            dev->driver_features = (dev->driver_features & 0xffffffffULL) | ((uint64_t)data << 32);
+        }
+        break;
+    case RANGE32(VIRTIO_MMIO_DRIVER_FEATURES_SEL, VIRTIO_MMIO_DRIVER_FEATURES_SEL):
+        dev->driver_features_sel = data;
+        break;
+    case RANGE32(VIRTIO_MMIO_QUEUE_SEL, VIRTIO_MMIO_QUEUE_SEL):
+        dev->queue_sel = data;
+        break;
+    case RANGE32(VIRTIO_MMIO_QUEUE_NUM, VIRTIO_MMIO_QUEUE_NUM):
+        if (vq && data <= VIRTIO_QUEUE_NUM_MAX) {
+            vq->num = data;
+        }
+        break;
+    case RANGE32(VIRTIO_MMIO_QUEUE_READY, VIRTIO_MMIO_QUEUE_READY):
+        if (vq) {
+            vq->ready = (data == 1) && vq->num != 0;
+        }
+        break;
+    case RANGE32(VIRTIO_MMIO_QUEUE_NOTIFY, VIRTIO_MMIO_QUEUE_NOTIFY):
+        if (data < dev->num_queues && dev->queue_notify) {
+            dev->queue_notify(dev, data);
+        }
+        break;
+    case RANGE32(VIRTIO_MMIO_INTERRUPT_ACK, VIRTIO_MMIO_INTERRUPT_ACK):
+        dev->interrupt_status &= ~data;
+        break;
+    case RANGE32(VIRTIO_MMIO_STATUS, VIRTIO_MMIO_STATUS):
+        if (data == 0) {
+            virtio_mmio_reset(dev);
+        } else {
+            dev->status = data;
+        }
+        break;
+    case RANGE32(VIRTIO_MMIO_QUEUE_DESC_LOW, VIRTIO_MMIO_QUEUE_DESC_LOW):
+        if (vq) {
+            vq->desc_addr = (vq->desc_addr & ~0xffffffffULL) | data;
+        }
+        break;
+    case RANGE32(VIRTIO_MMIO_QUEUE_DESC_HIGH, VIRTIO_MMIO_QUEUE_DESC_HIGH):
+        if (vq) {
+            vq->desc_addr = (vq->desc_addr & 0xffffffffULL) | ((uint64_t)data << 32);
+        }
+        break;
+    case RANGE32(VIRTIO_MMIO_QUEUE_AVAIL_LOW, VIRTIO_MMIO_QUEUE_AVAIL_LOW):
+        if (vq) {
+            vq->avail_addr = (vq->avail_addr & ~0xffffffffULL) | data;
+        }
+        break;
+    case RANGE32(VIRTIO_MMIO_QUEUE_AVAIL_HIGH, VIRTIO_MMIO_QUEUE_AVAIL_HIGH):
+        if (vq) {
+            vq->avail_addr = (vq->avail_addr & 0xffffffffULL) | ((uint64_t)data << 32);
+        }
+        break;
+    case RANGE32(VIRTIO_MMIO_QUEUE_USED_LOW, VIRTIO_MMIO_QUEUE_USED_LOW):
+        if (vq) {
+            vq->used_addr = (vq->used_addr & ~0xffffffffULL) | data;
+        }
+        break;
+    case RANGE32(VIRTIO_MMIO_QUEUE_USED_HIGH, VIRTIO_MMIO_QUEUE_USED_HIGH):
+        if (vq) {
+            vq->used_addr = (vq->used_addr & 0xffffffffULL) | ((uint64_t)data << 32);
+        }
+        break;
+    default:
+        /* None of our devices have a writeable configuration space */
+        LOG_VMM_ERR("virtIO write to unknown register offset 0x%lx\n", offset);
+        break;
+    }
+
+    return fault_advance_vcpu(ctx);
+}
+
+bool virtio_mmio_handle_fault(struct virtio_device *dev, uint64_t offset, uint64_t fault_addr, uint64_t fsr, struct fault_ctx *ctx)
+{
+    assert(offset < VIRTIO_MMIO_DEV_SIZE);
+    if (fault_is_read(fsr)) {
+        return virtio_mmio_reg_read(dev, offset, fault_addr, fsr, ctx);
+    } else {
+        return virtio_mmio_reg_write(dev, offset, fault_addr, fsr, ctx);
+    }
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright 2023, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <microkit.h>
+#include "../fault.h"
+
+/*
+ * Values in this file are taken from the:
+ * Virtual I/O Device (VIRTIO) Version 1.1
+ * Section 4.2.2: MMIO Device Register Layout
+ *
+ * We only implement the "modern" (version 2) interface, so the driver has to
+ * accept VIRTIO_F_VERSION_1.
+ */
+#define VIRTIO_MMIO_MAGIC_VALUE         0x000
+#define VIRTIO_MMIO_VERSION             0x004
+#define VIRTIO_MMIO_DEVICE_ID           0x008
+#define VIRTIO_MMIO_VENDOR_ID           0x00c
+#define VIRTIO_MMIO_DEVICE_FEATURES     0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES     0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024
+#define VIRTIO_MMIO_QUEUE_SEL           0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX       0x034
+#define VIRTIO_MMIO_QUEUE_NUM           0x038
+#define VIRTIO_MMIO_QUEUE_READY         0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY        0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS    0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK       0x064
+#define VIRTIO_MMIO_STATUS              0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW      0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH     0x084
+#define VIRTIO_MMIO_QUEUE_AVAIL_LOW     0x090
+#define VIRTIO_MMIO_QUEUE_AVAIL_HIGH    0x094
+#define VIRTIO_MMIO_QUEUE_USED_LOW      0x0a0
+#define VIRTIO_MMIO_QUEUE_USED_HIGH     0x0a4
+#define VIRTIO_MMIO_CONFIG_GENERATION   0x0fc
+#define VIRTIO_MMIO_CONFIG              0x100
+
+/* Size of the register region of a single device */
+#define VIRTIO_MMIO_DEV_SIZE            0x200
+
+/* "virt" in little endian */
+#define VIRTIO_MMIO_MAGIC               0x74726976
+#define VIRTIO_MMIO_DEV_VERSION         0x2
+/* Not a registered vendor, the driver does not care what this is */
+#define VIRTIO_MMIO_DEV_VENDOR_ID       0x344c6573
+
+#define VIRTIO_MMIO_INT_VRING           (1 << 0)
+#define VIRTIO_MMIO_INT_CONFIG          (1 << 1)
+
+#define VIRTIO_F_VERSION_1              32
+
+/* Section 2.6: Split Virtqueues */
+#define VIRTQ_DESC_F_NEXT               1
+#define VIRTQ_DESC_F_WRITE              2
+
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtq_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+};
+
+struct virtq_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct virtq_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct virtq_used_elem ring[];
+};
+
+/* The number of descriptors we tell the driver each queue can have at most. */
+#define VIRTIO_QUEUE_NUM_MAX            128
+/* The most queues any of our devices has. */
+#define VIRTIO_MMIO_MAX_QUEUES          2
+
+struct virtio_queue {
+    bool ready;
+    uint32_t num;
+    /* Guest physical addresses of each part of the virtqueue */
+    uint64_t desc_addr;
+    uint64_t avail_addr;
+    uint64_t used_addr;
+    /* Index in the available ring of the next buffer we have not seen yet */
+    uint16_t last_avail_idx;
+};
+
+struct virtio_device;
+
+/* Called when the guest tells us that there are new buffers in a queue. */
+typedef void (*virtio_queue_notify_fn_t)(struct virtio_device *dev, uint32_t queue);
+
+/*
+ * The state of a virtual device, this is shared between the MMIO transport
+ * and the device specific code (e.g the console).
+ */
+struct virtio_device {
+    uint32_t device_id;
+    /* Features we offer to the driver */
+    uint64_t features;
+    /* Features the driver has accepted */
+    uint64_t driver_features;
+    uint32_t device_features_sel;
+    uint32_t driver_features_sel;
+    uint32_t queue_sel;
+    uint32_t status;
+    uint32_t interrupt_status;
+    uint32_t num_queues;
+    struct virtio_queue queues[VIRTIO_MMIO_MAX_QUEUES];
+    /* Device specific configuration space */
+    void *config;
+    uint32_t config_size;
+    virtio_queue_notify_fn_t queue_notify;
+    /* Where the device's interrupts go */
+    uint64_t vcpu_id;
+    int virq;
+    /* For the device specific code */
+    void *data;
+};
+
+bool virtio_mmio_register_device(struct virtio_device *dev, uint64_t vcpu_id, int virq);
+bool virtio_mmio_handle_fault(struct virtio_device *dev, uint64_t offset, uint64_t fault_addr, uint64_t fsr, struct fault_ctx *ctx);
+
+/* Helpers for the device specific code to process a queue. */
+bool virtio_queue_pop(struct virtio_queue *vq, uint16_t *desc_head);
+struct virtq_desc *virtio_queue_desc(struct virtio_queue *vq, uint16_t idx);
+void *virtio_guest_to_vmm(uint64_t guest_addr, uint64_t len);
+void virtio_queue_push_used(struct virtio_queue *vq, uint16_t desc_head, uint32_t len);
+bool virtio_device_notify_used(struct virtio_device *dev);
@@ -7,14 +7,18 @@
 #include <stddef.h>
 #include <microkit.h>
 #include "util/util.h"
+#include "util/lz4.h"
 #include "vgic/vgic.h"
 #include "smc.h"
 #include "fault.h"
 #include "hsr.h"
 #include "vmm.h"
 #include "arch/aarch64/linux.h"
+#include "virtio/console.h"
 
-/* Data for the guest's kernel image. */
+/* Uncompressed header of the guest's kernel image. */
+extern char _guest_kernel_header[];
+/* Data for the guest's kernel image, LZ4 compressed. */
 extern char _guest_kernel_image[];
 extern char _guest_kernel_image_end[];
 /* Data for the device tree to be passed to the kernel. */
@@ -25,6 +29,17 @@ extern char _guest_initrd_image[];
 extern char _guest_initrd_image_end[];
 /* seL4CP will set this variable to the start of the guest RAM memory region. */
 uintptr_t guest_ram_vaddr;
+/* Memory region only the VMM can see, holding a copy of the loaded images. */
+uintptr_t guest_snapshot_vaddr;
+
+/* Where guest_init_images() placed each image in guest RAM, in address order. */
+struct guest_image_region {
+    uintptr_t vaddr;
+    uint64_t size;
+};
+#define GUEST_NUM_IMAGES 3
+static struct guest_image_region guest_images[GUEST_NUM_IMAGES];
+static bool guest_snapshot_valid;
 
 /* @jade: find a better number */
 #define MAX_IRQ_CH 32
@@ -34,7 +49,7 @@ int passthrough_irq_map[MAX_IRQ_CH];
 #define SYSCALL_PA_TO_IPA 65
 #define SYSCALL_NOP 67
 
-static bool handle_unknown_syscall(microkit_msginfo msginfo)
+static bool handle_unknown_syscall(microkit_msginfo msginfo, struct fault_ctx *ctx)
 {
     // @ivanv: should print out the name of the VM the fault came from.
     uint64_t syscall = microkit_mr_get(seL4_UnknownSyscall_Syscall);
@@ -55,38 +70,32 @@ static bool handle_unknown_syscall(microkit_msginfo msginfo)
             return false;
     }
 
-    seL4_UserContext regs;
-    seL4_Error err = seL4_TCB_ReadRegisters(BASE_VM_TCB_CAP + GUEST_ID, false, 0, SEL4_USER_CONTEXT_SIZE, &regs);
-    assert(!err);
-
-    return fault_advance_vcpu(&regs);
+    return fault_advance_vcpu(ctx);
 }
 
-static bool handle_vppi_event()
+static bool handle_vppi_event(uint64_t vcpu_id)
 {
     uint64_t ppi_irq = microkit_mr_get(seL4_VPPIEvent_IRQ);
     // We directly inject the interrupt assuming it has been previously registered.
     // If not the interrupt will dropped by the VM.
-    bool success = vgic_inject_irq(GUEST_VCPU_ID, ppi_irq);
+    bool success = vgic_inject_irq(vcpu_id, ppi_irq);
     if (!success) {
         // @ivanv, make a note that when having a lot of printing on it can cause this error
-        LOG_VMM_ERR("VPPI IRQ %lu dropped on vCPU %d\n", ppi_irq, GUEST_VCPU_ID);
+        LOG_VMM_ERR("VPPI IRQ %lu dropped on vCPU %d\n", ppi_irq, vcpu_id);
         // Acknowledge to unmask it as our guest will not use the interrupt
-        // @ivanv: We're going to assume that we only have one VCPU and that the
-        // cap is the base one.
-        microkit_vcpu_arm_ack_vppi(GUEST_ID, ppi_irq);
+        microkit_vcpu_arm_ack_vppi(vcpu_id, ppi_irq);
     }
 
     return true;
 }
 
-static bool handle_vcpu_fault(microkit_msginfo msginfo, uint64_t vcpu_id)
+static bool handle_vcpu_fault(microkit_msginfo msginfo, uint64_t vcpu_id, struct fault_ctx *ctx)
 {
     uint32_t hsr = microkit_mr_get(seL4_VCPUFault_HSR);
     uint64_t hsr_ec_class = HSR_EXCEPTION_CLASS(hsr);
     switch (hsr_ec_class) {
         case HSR_SMC_64_EXCEPTION:
-            return handle_smc(vcpu_id, hsr);
+            return handle_smc(vcpu_id, ctx, hsr);
         case HSR_WFx_EXCEPTION:
             // If we get a WFI exception, we just do nothing in the VMM.
             return true;
@@ -96,7 +105,7 @@ static bool handle_vcpu_fault(microkit_msginfo msginfo, uint64_t vcpu_id)
     }
 }
 
-static int handle_user_exception(microkit_msginfo msginfo)
+static int handle_user_exception(microkit_msginfo msginfo, struct fault_ctx *ctx)
 {
     // @ivanv: print out VM name/vCPU id when we have multiple VMs
     uint64_t fault_ip = microkit_mr_get(seL4_UserException_FaultIP);
@@ -104,76 +113,139 @@ static int handle_user_exception(microkit_msginfo msginfo)
     LOG_VMM_ERR("Invalid instruction fault at IP: 0x%lx, number: 0x%lx", fault_ip, number);
 
     // Dump registers
-    seL4_UserContext regs = {0};
-    seL4_Error ret = seL4_TCB_ReadRegisters(BASE_VM_TCB_CAP + GUEST_ID, false, 0, SEL4_USER_CONTEXT_SIZE, &regs);
-    if (ret != seL4_NoError) {
-        printf("Failure reading regs, error %d", ret);
-        return false;
-    } else {
-        print_tcb_regs(&regs);
-    }
+    print_tcb_regs(fault_ctx_regs(ctx));
 
     return true;
 }
 
+/*
+ * The guest sends us the word over a virtIO console. Linux already has a
+ * driver for it, so user-space only needs to write the word to /dev/hvc0.
+ * The guest hands over its output in batches through a virtqueue in guest RAM,
+ * so the only accesses that trap into the VMM are the queue notifications
+ * rather than one per byte.
+ *
+ * Guest kernels built without the virtIO console driver write the word into
+ * a page that is shared between the guest and the VMM instead, which does not
+ * cause any faults. Once the whole word is in the page, the guest writes the
+ * length of what it wrote to a doorbell register just after the page. The
+ * doorbell is not mapped into the guest, so that one write is the only access
+ * that traps into the VMM.
+ */
 #define WORDLE_WORD_SIZE 5
-#define WORDLE_BUFFER_ADDR 0x50000000
-#define WORDLE_BUFFER_SIZE (WORDLE_WORD_SIZE * sizeof(char))
 #define WORDLE_SERVER_CHANNEL 1
 
-char word[WORDLE_WORD_SIZE] = {0};
+#define WORDLE_BUFFER_ADDR 0x50000000
+#define WORDLE_BUFFER_SIZE 0x1000
+#define WORDLE_DOORBELL_ADDR (WORDLE_BUFFER_ADDR + WORDLE_BUFFER_SIZE)
+#define WORDLE_DOORBELL_SIZE 0x4
+
+/* Microkit will set this variable to the start of the shared buffer. */
+uintptr_t wordle_buffer_vaddr;
 
-static bool handle_vm_fault()
+#define VIRTIO_CONSOLE_PADDR 0x51000000
+#define VIRTIO_CONSOLE_SIZE VIRTIO_MMIO_DEV_SIZE
+/* SPI 42, this must match the "interrupts" property of the node in the DTB */
+#define VIRTIO_CONSOLE_IRQ 74
+
+static struct virtio_console console;
+
+/* Guest output accumulated until we see the end of a line. */
+static char console_line[WORDLE_WORD_SIZE];
+static uint32_t console_line_len;
+
+static void wordle_send_word(char *word)
 {
-    uint64_t addr = microkit_mr_get(seL4_VMFault_Addr);
-    uint64_t fsr = microkit_mr_get(seL4_VMFault_FSR);
+    for (uint64_t vcpu_id = 0; vcpu_id < GUEST_NUM_VCPUS; vcpu_id++) {
+        guest_vcpu_stop(vcpu_id);
+    }
+    microkit_msginfo msg = microkit_msginfo_new(0, WORDLE_WORD_SIZE);
+    for (int i = 0; i < WORDLE_WORD_SIZE; i++) {
+        microkit_mr_set(i, word[i]);
+    }
+    microkit_ppcall(WORDLE_SERVER_CHANNEL, msg);
+}
 
-    seL4_UserContext regs;
-    int err = seL4_TCB_ReadRegisters(BASE_VM_TCB_CAP + GUEST_ID, false, 0, SEL4_USER_CONTEXT_SIZE, &regs);
-    assert(err == seL4_NoError);
+static bool handle_wordle_doorbell(uint64_t fsr, struct fault_ctx *ctx)
+{
+    if (!fault_is_write(fsr)) {
+        // Nothing to read from the doorbell
+        return fault_advance(ctx, WORDLE_DOORBELL_ADDR, fsr, 0);
+    }
+    uint64_t len = fault_get_data(ctx, fsr);
+    if (len != WORDLE_WORD_SIZE) {
+        LOG_VMM_ERR("Invalid length 0x%lx written to Wordle doorbell\n", len);
+        return fault_advance_vcpu(ctx);
+    }
 
-    switch (addr) {
-        case WORDLE_BUFFER_ADDR...WORDLE_BUFFER_ADDR + WORDLE_BUFFER_SIZE: {
-            char character = fault_get_data(&regs, fsr);
-            word[(addr - WORDLE_BUFFER_ADDR) / sizeof(char)] = character;
-            if (addr == WORDLE_BUFFER_ADDR + (WORDLE_BUFFER_SIZE - sizeof(char))) {
-                microkit_vcpu_stop(GUEST_ID);
-                microkit_msginfo msg = microkit_msginfo_new(0, WORDLE_WORD_SIZE);
-                for (int i = 0; i < WORDLE_WORD_SIZE; i++) {
-                    microkit_mr_set(i, word[i]);
-                }
-                microkit_ppcall(WORDLE_SERVER_CHANNEL, msg);
-                return true;
-            } else {
-                return fault_advance_vcpu(&regs);
+    char word[WORDLE_WORD_SIZE];
+    volatile char *buffer = (volatile char *)wordle_buffer_vaddr;
+    for (int i = 0; i < WORDLE_WORD_SIZE; i++) {
+        word[i] = buffer[i];
+    }
+    wordle_send_word(word);
+
+    return true;
+}
+
+static void console_output(char *buf, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        if (buf[i] == '\n' || buf[i] == '\r') {
+            if (console_line_len == WORDLE_WORD_SIZE) {
+                wordle_send_word(console_line);
+            } else if (console_line_len != 0) {
+                LOG_VMM_ERR("Ignoring line of length %d from guest console\n", console_line_len);
             }
+            console_line_len = 0;
+        } else if (console_line_len < WORDLE_WORD_SIZE) {
+            console_line[console_line_len++] = buf[i];
+        } else {
+            /* Too long to be a word, keep counting so it gets rejected */
+            console_line_len = WORDLE_WORD_SIZE + 1;
         }
+    }
+}
+
+static bool handle_vm_fault(uint64_t vcpu_id, struct fault_ctx *ctx)
+{
+    uint64_t addr = microkit_mr_get(seL4_VMFault_Addr);
+    uint64_t fsr = microkit_mr_get(seL4_VMFault_FSR);
+
+    switch (addr) {
+        case VIRTIO_CONSOLE_PADDR...VIRTIO_CONSOLE_PADDR + VIRTIO_CONSOLE_SIZE - 1:
+            return virtio_mmio_handle_fault(&console.dev, addr - VIRTIO_CONSOLE_PADDR, addr, fsr, ctx);
+        case WORDLE_DOORBELL_ADDR...WORDLE_DOORBELL_ADDR + WORDLE_DOORBELL_SIZE - 1:
+            return handle_wordle_doorbell(fsr, ctx);
         case GIC_DIST_PADDR...GIC_DIST_PADDR + GIC_DIST_SIZE:
-            return handle_vgic_dist_fault(GUEST_VCPU_ID, addr, fsr, &regs);
+            return handle_vgic_dist_fault(vcpu_id, addr, fsr, ctx);
 #if defined(GIC_V3)
         /* Need to handle redistributor faults for GICv3 platforms. */
         case GIC_REDIST_PADDR...GIC_REDIST_PADDR + GIC_REDIST_SIZE:
-            return handle_vgic_redist_fault(GUEST_VCPU_ID, addr, fsr, &regs);
+            return handle_vgic_redist_fault(vcpu_id, addr, fsr, ctx);
 #endif
         default: {
             uint64_t ip = microkit_mr_get(seL4_VMFault_IP);
             uint64_t is_prefetch = seL4_GetMR(seL4_VMFault_PrefetchFault);
             uint64_t is_write = (fsr & (1 << 6)) != 0;
             LOG_VMM_ERR("unexpected memory fault on address: 0x%lx, FSR: 0x%lx, IP: 0x%lx, is_prefetch: %s, is_write: %s\n", addr, fsr, ip, is_prefetch ? "true" : "false", is_write ? "true" : "false");
-            print_tcb_regs(&regs);
-            print_vcpu_regs(GUEST_ID);
+            print_tcb_regs(fault_ctx_regs(ctx));
+            print_vcpu_regs(vcpu_id);
             return false;
         }
     }
 }
 
-#define SGI_RESCHEDULE_IRQ  0
-#define SGI_FUNC_CALL       1
+/*
+ * Linux uses the SGIs recommended for non-secure state (0 - 7) for IPIs
+ * between its CPUs (rescheduling, function calls, stopping CPUs etc).
+ */
+#define NUM_GUEST_SGIS      8
 #define PPI_VTIMER_IRQ      27
 
 static void vppi_event_ack(uint64_t vcpu_id, int irq, void *cookie)
 {
-    microkit_vcpu_arm_ack_vppi(GUEST_ID, irq);
+    microkit_vcpu_arm_ack_vppi(vcpu_id, irq);
 }
 
 static void sgi_ack(uint64_t vcpu_id, int irq, void *cookie) {}
@@ -186,7 +258,16 @@ static void serial_ack(uint64_t vcpu_id, int irq, void *cookie) {
     microkit_irq_ack(SERIAL_IRQ_CH);
 }
 
+/*
+ * A level-sensitive IRQ is acked once the guest has EOId it, if the device
+ * still asserts it we get it again straight away (so it is resampled). An
+ * edge-triggered IRQ is acked as soon as we have injected it instead, so that
+ * edges that arrive while the guest is handling it are latched by the vGIC.
+ */
 static void passthrough_device_ack(uint64_t vcpu_id, int irq, void *cookie) {
+    if (vgic_irq_is_edge_triggered(irq)) {
+        return;
+    }
     microkit_channel irq_ch = (microkit_channel)(int64_t)cookie;
     microkit_irq_ack(irq_ch);
 }
@@ -196,7 +277,7 @@ static void register_passthrough_irq(int irq, microkit_channel irq_ch) {
     assert(irq_ch < MAX_IRQ_CH);
     passthrough_irq_map[irq_ch] = irq;
 
-    int err = vgic_register_irq(GUEST_VCPU_ID, irq, &passthrough_device_ack, (void *)(int64_t)irq_ch);
+    int err = vgic_register_irq(GUEST_BOOT_VCPU_ID, irq, &passthrough_device_ack, (void *)(int64_t)irq_ch);
     if (!err) {
         LOG_VMM_ERR("Failed to register IRQ %d\n", irq);
         return;
@@ -207,37 +288,92 @@ bool guest_init_images(void) {
     // First we inspect the kernel image header to confirm it is a valid image
     // and to determine where in memory to place the image. Currently this
     // process assumes the guest is the Linux kernel.
-    struct linux_image_header *image_header = (struct linux_image_header *) &_guest_kernel_image;
+    struct linux_image_header *image_header = (struct linux_image_header *) &_guest_kernel_header;
     assert(image_header->magic == LINUX_IMAGE_MAGIC);
     if (image_header->magic != LINUX_IMAGE_MAGIC) {
         LOG_VMM_ERR("Linux kernel image magic check failed\n");
         return false;
     }
-    // Copy the guest kernel image into the right location
+    // Decompress the guest kernel image into the right location
     uint64_t kernel_image_size = _guest_kernel_image_end - _guest_kernel_image;
     uint64_t kernel_image_vaddr = guest_ram_vaddr + image_header->text_offset;
     // This check is because the Linux kernel image requires to be placed at text_offset of
     // a 2MiB aligned base address anywhere in usable system RAM and called there.
     // In this case, we place the image at the text_offset of the start of the guest's RAM,
     // so we need to make sure that the start of guest RAM is 2MiB aligned.
-    //
-    // @ivanv: Ideally this check would be done at build time, we have all the information
-    // we need at build time to enforce this.
+    // guest_layout.py checks this at build time already.
     assert((guest_ram_vaddr & ((1 << 20) - 1)) == 0);
-    LOG_VMM("Copying guest kernel image to 0x%x (0x%x bytes)\n", kernel_image_vaddr, kernel_image_size);
-    memcpy((char *)kernel_image_vaddr, _guest_kernel_image, kernel_image_size);
+    // The initial RAM disk is placed after the kernel, so the kernel must not
+    // run into it.
+    if (kernel_image_vaddr >= GUEST_INIT_RAM_DISK_VADDR) {
+        LOG_VMM_ERR("Guest kernel image at 0x%lx would overlap initial RAM disk\n", kernel_image_vaddr);
+        return false;
+    }
+    uint64_t kernel_image_max_size = GUEST_INIT_RAM_DISK_VADDR - kernel_image_vaddr;
+    LOG_VMM("Decompressing guest kernel image to 0x%x (0x%x bytes compressed)\n", kernel_image_vaddr, kernel_image_size);
+    size_t kernel_image_len;
+    if (!lz4_legacy_decompress(_guest_kernel_image, kernel_image_size, (void *)kernel_image_vaddr,
+                               kernel_image_max_size, &kernel_image_len)) {
+        LOG_VMM_ERR("Could not decompress guest kernel image\n");
+        return false;
+    }
+    LOG_VMM("Guest kernel image is 0x%x bytes\n", kernel_image_len);
+    guest_images[0] = (struct guest_image_region) { kernel_image_vaddr, kernel_image_len };
     // Copy the guest device tree blob into the right location
     uint64_t dtb_image_size = _guest_dtb_image_end - _guest_dtb_image;
     LOG_VMM("Copying guest DTB to 0x%x (0x%x bytes)\n", GUEST_DTB_VADDR, dtb_image_size);
     memcpy((char *)GUEST_DTB_VADDR, _guest_dtb_image, dtb_image_size);
+    guest_images[2] = (struct guest_image_region) { GUEST_DTB_VADDR, dtb_image_size };
     // Copy the initial RAM disk into the right location
     uint64_t initrd_image_size = _guest_initrd_image_end - _guest_initrd_image;
     LOG_VMM("Copying guest initial RAM disk to 0x%x (0x%x bytes)\n", GUEST_INIT_RAM_DISK_VADDR, initrd_image_size);
     memcpy((char *)GUEST_INIT_RAM_DISK_VADDR, _guest_initrd_image, initrd_image_size);
+    guest_images[1] = (struct guest_image_region) { GUEST_INIT_RAM_DISK_VADDR, initrd_image_size };
 
     return true;
 }
 
+/*
+ * Once the images have been loaded, we keep a copy of them in the snapshot
+ * region so that restarting the guest is a plain copy back rather than
+ * decompressing the kernel again. Only the parts of guest RAM that hold an
+ * image are copied, as that is all the guest needs to boot again.
+ *
+ * We cannot snapshot the guest at a later point (e.g after it has booted) as
+ * the state of the passthrough devices cannot be captured, and since guest RAM
+ * is mapped into the guest directly we also have no way of knowing which pages
+ * it has written to.
+ */
+static void guest_snapshot_take(void)
+{
+    uint64_t total_size = 0;
+    for (int i = 0; i < GUEST_NUM_IMAGES; i++) {
+        total_size += guest_images[i].size;
+    }
+    if (total_size > GUEST_SNAPSHOT_SIZE) {
+        LOG_VMM_ERR("Guest images (0x%lx bytes) do not fit in snapshot (0x%lx bytes), restarts will reload them\n",
+                    total_size, (uint64_t)GUEST_SNAPSHOT_SIZE);
+        return;
+    }
+    char *snapshot = (char *)guest_snapshot_vaddr;
+    for (int i = 0; i < GUEST_NUM_IMAGES; i++) {
+        memcpy(snapshot, (char *)guest_images[i].vaddr, guest_images[i].size);
+        snapshot += guest_images[i].size;
+    }
+    guest_snapshot_valid = true;
+    LOG_VMM("Took snapshot of guest images (0x%lx bytes)\n", total_size);
+}
+
+static void guest_snapshot_restore(void)
+{
+    assert(guest_snapshot_valid);
+    char *snapshot = (char *)guest_snapshot_vaddr;
+    for (int i = 0; i < GUEST_NUM_IMAGES; i++) {
+        memcpy((char *)guest_images[i].vaddr, snapshot, guest_images[i].size);
+        snapshot += guest_images[i].size;
+    }
+}
+
 void guest_start(void) {
     // Initialise the virtual GIC driver
     vgic_init();
@@ -248,45 +384,86 @@ void guest_start(void) {
 #else
 #error "Unsupported GIC version"
 #endif
-    bool err = vgic_register_irq(GUEST_VCPU_ID, PPI_VTIMER_IRQ, &vppi_event_ack, NULL);
-    if (!err) {
-        LOG_VMM_ERR("Failed to register vCPU virtual timer IRQ: 0x%lx\n", PPI_VTIMER_IRQ);
-        return;
-    }
-    err = vgic_register_irq(GUEST_VCPU_ID, SGI_RESCHEDULE_IRQ, &sgi_ack, NULL);
-    if (!err) {
-        LOG_VMM_ERR("Failed to register vCPU SGI 0 IRQ");
-        return;
+    bool err;
+    for (uint64_t vcpu_id = 0; vcpu_id < GUEST_NUM_VCPUS; vcpu_id++) {
+        err = vgic_register_irq(vcpu_id, PPI_VTIMER_IRQ, &vppi_event_ack, NULL);
+        if (!err) {
+            LOG_VMM_ERR("Failed to register vCPU %d virtual timer IRQ: 0x%lx\n", vcpu_id, PPI_VTIMER_IRQ);
+            return;
+        }
+        for (int sgi = 0; sgi < NUM_GUEST_SGIS; sgi++) {
+            err = vgic_register_irq(vcpu_id, sgi, &sgi_ack, NULL);
+            if (!err) {
+                LOG_VMM_ERR("Failed to register vCPU %d SGI %d IRQ\n", vcpu_id, sgi);
+                return;
+            }
+        }
     }
-    err = vgic_register_irq(GUEST_VCPU_ID, SGI_FUNC_CALL, &sgi_ack, NULL);
+
+    // Register the IRQ for the passthrough serial
+    register_passthrough_irq(79, 2);
+
+    console_line_len = 0;
+    err = virtio_console_init(&console, GUEST_BOOT_VCPU_ID, VIRTIO_CONSOLE_IRQ, &console_output);
     if (!err) {
-        LOG_VMM_ERR("Failed to register vCPU SGI 1 IRQ");
+        LOG_VMM_ERR("Failed to initialise virtIO console\n");
         return;
     }
 
-    // Register the IRQ for the passthrough serial
-    register_passthrough_irq(79, 2);
+    // Read the entry point and set it to the program counter
+    struct linux_image_header *image_header = (struct linux_image_header *) &_guest_kernel_header;
+    uint64_t kernel_image_vaddr = guest_ram_vaddr + image_header->text_offset;
+    // Only the boot vCPU is started, the guest turns on the others with PSCI.
+    LOG_VMM("starting guest at 0x%lx, DTB at 0x%lx, initial RAM disk at 0x%lx\n",
+        kernel_image_vaddr, GUEST_DTB_VADDR, GUEST_INIT_RAM_DISK_VADDR);
+    err = guest_vcpu_start(GUEST_BOOT_VCPU_ID, kernel_image_vaddr, GUEST_DTB_VADDR);
+    assert(err);
+}
+
+/* Whether each of the guest's vCPUs is running, as far as the guest is concerned. */
+static bool vcpu_on_state[GUEST_NUM_VCPUS];
+
+bool guest_vcpu_is_on(uint64_t vcpu_id)
+{
+    assert(vcpu_id < GUEST_NUM_VCPUS);
+    return vcpu_on_state[vcpu_id];
+}
 
+bool guest_vcpu_start(uint64_t vcpu_id, uintptr_t entry_point, uint64_t x0)
+{
+    assert(vcpu_id < GUEST_NUM_VCPUS);
     seL4_UserContext regs = {0};
-    regs.x0 = GUEST_DTB_VADDR;
+    regs.x0 = x0;
     regs.spsr = 5; // PMODE_EL1h
-    // Read the entry point and set it to the program counter
-    struct linux_image_header *image_header = (struct linux_image_header *) &_guest_kernel_image;
-    uint64_t kernel_image_vaddr = guest_ram_vaddr + image_header->text_offset;
-    regs.pc = kernel_image_vaddr;
+    regs.pc = entry_point;
     // Set all the TCB registers
-    err = seL4_TCB_WriteRegisters(
-        BASE_VM_TCB_CAP + GUEST_ID,
-        false, // We'll explcitly start the guest below rather than in this call
+    int err = seL4_TCB_WriteRegisters(
+        BASE_VM_TCB_CAP + vcpu_id,
+        false, // We'll explcitly start the vCPU below rather than in this call
         0, // No flags
         SEL4_USER_CONTEXT_SIZE, // Writing to x0, pc, and spsr // @ivanv: for some reason having the number of registers here does not work... (in this case 2)
         &regs
     );
     assert(!err);
-    // Set the PC to the kernel image's entry point and start the thread.
-    LOG_VMM("starting guest at 0x%lx, DTB at 0x%lx, initial RAM disk at 0x%lx\n",
-        regs.pc, regs.x0, GUEST_INIT_RAM_DISK_VADDR);
-    microkit_vcpu_restart(GUEST_ID, regs.pc);
+    if (err) {
+        return false;
+    }
+#if CONFIG_MAX_NUM_NODES > 1
+    /* Each vCPU gets the MPIDR that matches the "reg" of its node in the DTB */
+    microkit_vcpu_arm_write_reg(vcpu_id, seL4_VCPUReg_VMPIDR_EL2, GUEST_VCPU_MPIDR(vcpu_id));
+#endif /* CONFIG_MAX_NUM_NODES > 1 */
+    // Set the PC to the entry point and start the thread.
+    microkit_vcpu_restart(vcpu_id, regs.pc);
+    vcpu_on_state[vcpu_id] = true;
+
+    return true;
+}
+
+void guest_vcpu_stop(uint64_t vcpu_id)
+{
+    assert(vcpu_id < GUEST_NUM_VCPUS);
+    microkit_vcpu_stop(vcpu_id);
+    vcpu_on_state[vcpu_id] = false;
 }
 
 #define SCTLR_EL1_UCI       (1 << 26)     /* Enable EL0 access to DC CVAU, DC CIVAC, DC CVAC,
@@ -306,59 +483,83 @@ void guest_start(void) {
 #define SCTLR_EL1_NATIVE   (SCTLR_EL1 | SCTLR_EL1_C | SCTLR_EL1_I | SCTLR_EL1_UCI)
 #define SCTLR_DEFAULT      SCTLR_EL1_NATIVE
 
+/*
+ * seL4 can only write one vCPU register per system call, so like a real CPU
+ * coming out of reset, we only reset the registers that the Linux arm64 boot
+ * protocol needs in a known state: the MMU and caches must be off, the virtual
+ * timer must not fire, and CNTVOFF must be the same on every CPU. The general
+ * purpose registers are written all at once when the vCPU is started, and the
+ * MPIDR is set there too. Every other EL1 register is UNKNOWN at reset on real
+ * hardware and Linux programs it before relying on it.
+ */
+static void vcpu_reset(uint64_t vcpu_id)
+{
+    microkit_vcpu_arm_write_reg(vcpu_id, seL4_VCPUReg_SCTLR, 0);
+    /* generic timer registers */
+    microkit_vcpu_arm_write_reg(vcpu_id, seL4_VCPUReg_CNTV_CTL, 0);
+    microkit_vcpu_arm_write_reg(vcpu_id, seL4_VCPUReg_CNTVOFF, 0);
+}
+
 void guest_stop(void) {
     LOG_VMM("Stopping guest\n");
-    microkit_vcpu_stop(GUEST_ID);
+    fault_print_stats();
+    vgic_print_stats();
+    for (uint64_t vcpu_id = 0; vcpu_id < GUEST_NUM_VCPUS; vcpu_id++) {
+        guest_vcpu_stop(vcpu_id);
+    }
     LOG_VMM("Stopped guest\n");
 }
 
+/*
+ * Linux does not expect RAM to be zero when it boots, all it needs are the
+ * images we place in it, and it clears its own BSS. So by default restarting
+ * the guest only reloads the images. Building with GUEST_RAM_SCRUB_ON_RESTART
+ * (see the Makefile) also clears the rest of guest RAM, for when nothing from
+ * before the restart may be left behind. We have no way of knowing which
+ * parts of RAM the guest has used since it is mapped into the guest directly,
+ * so all of it is cleared, except where the images go as they are written
+ * again straight after.
+ */
+static void guest_ram_scrub(void)
+{
+    uintptr_t vaddr = guest_ram_vaddr;
+    for (int i = 0; i < GUEST_NUM_IMAGES; i++) {
+        assert(guest_images[i].vaddr >= vaddr);
+        memset((char *)vaddr, 0, guest_images[i].vaddr - vaddr);
+        vaddr = guest_images[i].vaddr + guest_images[i].size;
+    }
+    memset((char *)vaddr, 0, guest_ram_vaddr + GUEST_RAM_SIZE - vaddr);
+}
+
 bool guest_restart(void) {
     LOG_VMM("Attempting to restart guest\n");
+    fault_print_stats();
+    vgic_print_stats();
     // First, stop the guest
-    microkit_vcpu_stop(GUEST_ID);
+    for (uint64_t vcpu_id = 0; vcpu_id < GUEST_NUM_VCPUS; vcpu_id++) {
+        guest_vcpu_stop(vcpu_id);
+    }
     LOG_VMM("Stopped guest\n");
-    // Then, we need to clear all of RAM
+#if defined(GUEST_RAM_SCRUB_ON_RESTART)
+    // Then, we need to clear RAM
     LOG_VMM("Clearing guest RAM\n");
-    memset((char *)guest_ram_vaddr, 0, GUEST_RAM_SIZE);
+    guest_ram_scrub();
+#endif
     // Copy back the images into RAM
-    bool success = guest_init_images();
-    if (!success) {
-        LOG_VMM_ERR("Failed to initialise guest images\n");
-        return false;
+    if (guest_snapshot_valid) {
+        LOG_VMM("Restoring guest images from snapshot\n");
+        guest_snapshot_restore();
+    } else {
+        bool success = guest_init_images();
+        if (!success) {
+            LOG_VMM_ERR("Failed to initialise guest images\n");
+            return false;
+        }
     }
     // Reset registers
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_SCTLR, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_TTBR0, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_TTBR1, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_TCR, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_MAIR, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_AMAIR, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_CIDR, 0);
-    /* other system registers EL1 */
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_ACTLR, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_CPACR, 0);
-    /* exception handling registers EL1 */
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_AFSR0, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_AFSR1, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_ESR, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_FAR, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_ISR, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_VBAR, 0);
-    /* thread pointer/ID registers EL0/EL1 */
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_TPIDR_EL1, 0);
-#if CONFIG_MAX_NUM_NODES > 1
-    /* Virtualisation Multiprocessor ID Register */
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_VMPIDR_EL2, 0);
-#endif /* CONFIG_MAX_NUM_NODES > 1 */
-    /* general registers x0 to x30 have been saved by traps.S */
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_SP_EL1, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_ELR_EL1, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_SPSR_EL1, 0); // 32-bit
-    /* generic timer registers, to be completed */
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_CNTV_CTL, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_CNTV_CVAL, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_CNTVOFF, 0);
-    microkit_vcpu_arm_write_reg(GUEST_ID, seL4_VCPUReg_CNTKCTL_EL1, 0);
+    for (uint64_t vcpu_id = 0; vcpu_id < GUEST_NUM_VCPUS; vcpu_id++) {
+        vcpu_reset(vcpu_id);
+    }
     // Now we need to re-initialise all the VMM state
     guest_start();
     LOG_VMM("Restarted guest\n");
@@ -376,6 +577,7 @@ init(void)
         LOG_VMM_ERR("Failed to initialise guest images\n");
         assert(0);
     }
+    guest_snapshot_take();
     // Initialise and start guest (setup VGIC, setup interrupts, TCB registers)
     guest_start();
 }
@@ -385,17 +587,21 @@ notified(microkit_channel ch)
 {
     switch (ch) {
         case SERIAL_IRQ_CH: {
-            bool success = vgic_inject_irq(GUEST_VCPU_ID, SERIAL_IRQ);
+            bool success = vgic_inject_irq(GUEST_BOOT_VCPU_ID, SERIAL_IRQ);
             if (!success) {
-                LOG_VMM_ERR("IRQ %d dropped on vCPU %d\n", SERIAL_IRQ, GUEST_VCPU_ID);
+                LOG_VMM_ERR("IRQ %d dropped on vCPU %d\n", SERIAL_IRQ, GUEST_BOOT_VCPU_ID);
             }
             break;
         }
         default:
             if (passthrough_irq_map[ch]) {
-                bool success = vgic_inject_irq(GUEST_VCPU_ID, passthrough_irq_map[ch]);
+                int irq = passthrough_irq_map[ch];
+                bool success = vgic_inject_irq(GUEST_BOOT_VCPU_ID, irq);
                 if (!success) {
-                    LOG_VMM_ERR("IRQ %d dropped on vCPU %d\n", passthrough_irq_map[ch], GUEST_VCPU_ID);
+                    LOG_VMM_ERR("IRQ %d dropped on vCPU %d\n", irq, GUEST_BOOT_VCPU_ID);
+                }
+                if (vgic_irq_is_edge_triggered(irq)) {
+                    microkit_irq_ack(ch);
                 }
                 break;
             }
@@ -406,36 +612,39 @@ notified(microkit_channel ch)
 seL4_Bool
 fault(microkit_child id, microkit_msginfo msginfo, microkit_msginfo *reply_msginfo)
 {
-    if (id != GUEST_ID) {
+    // The guest's vCPUs are our only children, the ID is that of the vCPU.
+    if (id >= GUEST_NUM_VCPUS) {
         LOG_VMM_ERR("Unexpected faulting PD/VM with id %d\n", id);
         return seL4_False;
     }
+    uint64_t vcpu_id = id;
     // This is the primary fault handler for the guest, all faults that come
     // from seL4 regarding the guest will need to be handled here.
     uint64_t label = microkit_msginfo_get_label(msginfo);
+    struct fault_ctx *ctx = fault_ctx_begin(vcpu_id, label);
     bool success = false;
     switch (label) {
         case seL4_Fault_VMFault:
-            success = handle_vm_fault();
+            success = handle_vm_fault(vcpu_id, ctx);
             break;
         case seL4_Fault_UnknownSyscall:
-            success = handle_unknown_syscall(msginfo);
+            success = handle_unknown_syscall(msginfo, ctx);
             break;
         case seL4_Fault_UserException:
-            success = handle_user_exception(msginfo);
+            success = handle_user_exception(msginfo, ctx);
             break;
         case seL4_Fault_VGICMaintenance:
-            success = handle_vgic_maintenance(GUEST_VCPU_ID);
+            success = handle_vgic_maintenance(vcpu_id);
             break;
         case seL4_Fault_VCPUFault:
-            success = handle_vcpu_fault(msginfo, GUEST_VCPU_ID);
+            success = handle_vcpu_fault(msginfo, vcpu_id, ctx);
             break;
         case seL4_Fault_VPPIEvent:
-            success = handle_vppi_event();
+            success = handle_vppi_event(vcpu_id);
             break;
         default:
             LOG_VMM_ERR("unknown fault, stopping VM with ID %d\n", id);
-            microkit_vcpu_stop(id);
+            guest_vcpu_stop(vcpu_id);
             return seL4_False;
             // @ivanv: print out the actual fault details
     }
@@ -445,7 +654,13 @@ fault(microkit_child id, microkit_msginfo msginfo, microkit_msginfo *reply_msgin
         return seL4_False;
     }
 
-    *reply_msginfo = microkit_msginfo_new(0, 0);
+    // Get whatever registers the handler changed back to the vCPU, either
+    // in the reply or by writing them. The vCPU is then resumed by the reply.
+    success = fault_ctx_commit(ctx, reply_msginfo);
+    if (!success) {
+        LOG_VMM_ERR("Failed to write back registers for %s fault\n", fault_to_string(label));
+        return seL4_False;
+    }
 
     return seL4_True;
 }
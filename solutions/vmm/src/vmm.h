@@ -1,50 +1,29 @@
 #include <stdint.h>
 
-// @ivanv: ideally we would have none of these hardcoded values
-// initrd, ram size come from the DTB
-// We can probably add a node for the DTB addr and then use that.
-// Part of the problem is that we might need multiple DTBs for the same example
-// e.g one DTB for VMM one, one DTB for VMM two. we should be able to hide all
-// of this in the build system to avoid doing any run-time DTB stuff.
-#if defined(BOARD_qemu_virt_aarch64)
-#define GUEST_DTB_VADDR 0x4f000000
-#define GUEST_INIT_RAM_DISK_VADDR 0x4d700000
-#define GUEST_RAM_SIZE 0x10000000
-#elif defined(BOARD_rpi4b_hyp)
-#define GUEST_DTB_VADDR 0x2e000000
-#define GUEST_INIT_RAM_DISK_VADDR 0x2d700000
-#define GUEST_RAM_SIZE 0x10000000
-#elif defined(BOARD_odroidc2_hyp)
-#define GUEST_DTB_VADDR 0x2f000000
-#define GUEST_INIT_RAM_DISK_VADDR 0x2d700000
-#define GUEST_RAM_SIZE 0x10000000
-#elif defined(BOARD_odroidc4_hyp)
-#define GUEST_DTB_VADDR 0x2f000000
-#define GUEST_INIT_RAM_DISK_VADDR 0x2d700000
-#define GUEST_RAM_SIZE 0x10000000
-#elif defined(BOARD_imx8mm_evk_hyp)
-#define GUEST_DTB_VADDR 0x4f000000
-#define GUEST_INIT_RAM_DISK_VADDR 0x4d700000
-#define GUEST_RAM_SIZE 0x10000000
-#else
-#error Need to define VM image address and DTB address
-#endif
+/*
+ * Where the guest's RAM is and where the images go in it. This is generated at
+ * build time from the system description and the images, see
+ * vmm/tools/guest_layout.py.
+ */
+#include "guest_layout.h"
 
+/* The tutorial's system description is only for QEMU's virt platform. */
 #if defined(BOARD_qemu_virt_aarch64)
 #define SERIAL_IRQ_CH 1
 #define SERIAL_IRQ 33
-#elif defined(BOARD_odroidc2_hyp) || defined(BOARD_odroidc4_hyp)
-#define SERIAL_IRQ_CH 1
-#define SERIAL_IRQ 225
-#elif defined(BOARD_rpi4b_hyp)
-#define SERIAL_IRQ_CH 1
-#define SERIAL_IRQ 57
-#elif defined(BOARD_imx8mm_evk_hyp)
-#define SERIAL_IRQ_CH 1
-#define SERIAL_IRQ 79
 #else
-#error Need to define serial interrupt
+#error Only the qemu_virt_aarch64 board is supported
 #endif
 
+/*
+ * The MPIDR the guest sees on each vCPU, bit 31 is RES1 and the vCPU ID is
+ * the lowest affinity level. This is also what the guest uses to refer to a
+ * vCPU in PSCI calls and what the "reg" of each CPU node in the DTB must be.
+ */
+#define GUEST_VCPU_MPIDR(vcpu_id) ((1UL << 31) | (vcpu_id))
+
 bool guest_restart(void);
 void guest_stop(void);
+bool guest_vcpu_start(uint64_t vcpu_id, uintptr_t entry_point, uint64_t x0);
+void guest_vcpu_stop(uint64_t vcpu_id);
+bool guest_vcpu_is_on(uint64_t vcpu_id);
@@ -0,0 +1,229 @@
+/*
+ * Copyright 2023, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Checks the VMM's memcpy and memset for every size up to a few cache blocks
+ * at every alignment, including that memset zeroes exactly the whole blocks
+ * it should with DC ZVA, then compares their throughput with copying and
+ * setting a byte at a time.
+ *
+ * DC ZVA is emulated on the host (see stubs.c), so the memset benchmark is
+ * done without it, only the word at a time path is measured.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "stubs.h"
+#include "../src/util/util.h"
+
+/* Room for the largest size at the largest offset, with guard bytes either side */
+#define MAX_SIZE 600
+#define MAX_ALIGN 16
+#define GUARD 64
+#define BUF_SIZE (GUARD + MAX_ALIGN + MAX_SIZE + GUARD)
+#define GUARD_BYTE 0xee
+
+#define BENCH_ITERATIONS_SMALL 200000
+#define BENCH_SMALL (4 * 1024)
+#define BENCH_ITERATIONS_LARGE 20
+#define BENCH_LARGE (16 * 1024 * 1024)
+
+static const size_t zva_block_sizes[] = { 0, 64, 128, 256 };
+/* memset only uses the low byte */
+static const int set_values[] = { 0, 0xa5, 0x100 };
+
+static unsigned char src_buf[BUF_SIZE] __attribute__((aligned(256)));
+static unsigned char dst_buf[BUF_SIZE] __attribute__((aligned(256)));
+
+static int failures;
+
+#define CHECK(expr, ...) \
+    do { \
+        if (!(expr) && failures++ < 10) { \
+            printf("FAIL: %s: ", #expr); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+        } \
+    } while (0)
+
+static void fill(unsigned char *buf, size_t n, unsigned char seed)
+{
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = seed + i * 7;
+    }
+}
+
+/* Everything but [start, start + n) still holds the guard byte */
+static bool guards_intact(size_t start, size_t n)
+{
+    for (size_t i = 0; i < BUF_SIZE; i++) {
+        if ((i < start || i >= start + n) && dst_buf[i] != GUARD_BYTE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_memcpy(void)
+{
+    for (size_t n = 0; n <= MAX_SIZE; n++) {
+        for (size_t s = 0; s < MAX_ALIGN; s++) {
+            for (size_t d = 0; d < MAX_ALIGN; d++) {
+                unsigned char *src = src_buf + GUARD + s;
+                unsigned char *dst = dst_buf + GUARD + d;
+                fill(src_buf, BUF_SIZE, n + s);
+                for (size_t i = 0; i < BUF_SIZE; i++) {
+                    dst_buf[i] = GUARD_BYTE;
+                }
+
+                void *ret = memcpy(dst, src, n);
+                CHECK(ret == dst, "size %zu, src offset %zu, dst offset %zu", n, s, d);
+                bool same = true;
+                for (size_t i = 0; i < n; i++) {
+                    same = same && dst[i] == src[i];
+                }
+                CHECK(same, "size %zu, src offset %zu, dst offset %zu", n, s, d);
+                CHECK(guards_intact(GUARD + d, n), "size %zu, src offset %zu, dst offset %zu", n, s, d);
+            }
+        }
+    }
+}
+
+/* What memset should zero with DC ZVA: whole blocks, once there is at least a block left past the head */
+static uint64_t expected_zva_calls(uintptr_t start, size_t n, size_t block_size)
+{
+    if (block_size == 0) {
+        return 0;
+    }
+    uintptr_t end = start + n;
+    uintptr_t word_start = (start + UTIL_WORD_SIZE - 1) & ~(UTIL_WORD_SIZE - 1);
+    if (word_start > end || end - word_start < block_size) {
+        return 0;
+    }
+    uintptr_t block_start = (word_start + block_size - 1) & ~(block_size - 1);
+    return (end - block_start) / block_size;
+}
+
+static void test_memset(void)
+{
+    for (int z = 0; z < ARRAY_SIZE(zva_block_sizes); z++) {
+        size_t block_size = zva_block_sizes[z];
+        stub_set_dc_zva_block_size(block_size);
+        for (int v = 0; v < ARRAY_SIZE(set_values); v++) {
+            int c = set_values[v];
+            for (size_t n = 0; n <= MAX_SIZE; n++) {
+                for (size_t d = 0; d < MAX_ALIGN; d++) {
+                    unsigned char *dst = dst_buf + GUARD + d;
+                    for (size_t i = 0; i < BUF_SIZE; i++) {
+                        dst_buf[i] = GUARD_BYTE;
+                    }
+                    /* Mark the blocks so that DC ZVA has something to zero */
+                    fill(dst, n, 1 + n);
+
+                    stub_reset();
+                    void *ret = memset(dst, c, n);
+                    CHECK(ret == dst, "size %zu, offset %zu", n, d);
+                    bool set = true;
+                    for (size_t i = 0; i < n; i++) {
+                        set = set && dst[i] == (unsigned char)c;
+                    }
+                    CHECK(set, "value 0x%x, size %zu, offset %zu, DC ZVA block size %zu", c, n, d, block_size);
+                    CHECK(guards_intact(GUARD + d, n), "value 0x%x, size %zu, offset %zu, DC ZVA block size %zu",
+                          c, n, d, block_size);
+                    uint64_t zva = (unsigned char)c == 0 ? expected_zva_calls((uintptr_t)dst, n, block_size) : 0;
+                    CHECK(stub_dc_zva_calls == zva, "value 0x%x, size %zu, offset %zu, DC ZVA block size %zu: "
+                          "%lu blocks zeroed, expected %lu", c, n, d, block_size, stub_dc_zva_calls, zva);
+                }
+            }
+        }
+    }
+    stub_set_dc_zva_block_size(STUB_DC_ZVA_BLOCK_SIZE);
+}
+
+/* The byte at a time versions, kept from being turned into library calls or vectorised */
+__attribute__((noinline, optimize("no-tree-loop-distribute-patterns", "no-tree-vectorize")))
+static void *memcpy_bytes(void *dest, const void *src, size_t n)
+{
+    unsigned char *d = dest;
+    const unsigned char *s = src;
+    for (; n; n--) *d++ = *s++;
+    return dest;
+}
+
+__attribute__((noinline, optimize("no-tree-loop-distribute-patterns", "no-tree-vectorize")))
+static void *memset_bytes(void *dest, int c, size_t n)
+{
+    unsigned char *s = dest;
+    for (; n; n--) *s++ = c;
+    return dest;
+}
+
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* MiB per second for iterations of n bytes in elapsed ns */
+static double throughput(size_t n, int iterations, uint64_t elapsed)
+{
+    return (double)n * iterations / (1024 * 1024) / ((double)elapsed / 1000000000);
+}
+
+static void bench(const char *name, size_t n, int iterations)
+{
+    unsigned char *src = malloc(n);
+    unsigned char *dst = malloc(n);
+    fill(src, n, 0);
+    fill(dst, n, 1);
+
+    uint64_t start = time_ns();
+    for (int i = 0; i < iterations; i++) {
+        memcpy(dst, src, n);
+    }
+    uint64_t copy = time_ns() - start;
+    start = time_ns();
+    for (int i = 0; i < iterations; i++) {
+        memcpy_bytes(dst, src, n);
+    }
+    uint64_t copy_bytes = time_ns() - start;
+
+    start = time_ns();
+    for (int i = 0; i < iterations; i++) {
+        memset(dst, 0, n);
+    }
+    uint64_t set = time_ns() - start;
+    start = time_ns();
+    for (int i = 0; i < iterations; i++) {
+        memset_bytes(dst, 0, n);
+    }
+    uint64_t set_bytes = time_ns() - start;
+
+    printf("BENCH: %s memcpy %8.0f MiB/s (byte at a time %8.0f MiB/s), memset %8.0f MiB/s (byte at a time %8.0f MiB/s)\n",
+           name, throughput(n, iterations, copy), throughput(n, iterations, copy_bytes),
+           throughput(n, iterations, set), throughput(n, iterations, set_bytes));
+    free(src);
+    free(dst);
+}
+
+int main(void)
+{
+    test_memcpy();
+    test_memset();
+    if (failures) {
+        printf("FAIL: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("PASS: memcpy and memset\n");
+
+    stub_set_dc_zva_block_size(0);
+    bench("4 KiB ", BENCH_SMALL, BENCH_ITERATIONS_SMALL);
+    bench("16 MiB", BENCH_LARGE, BENCH_ITERATIONS_LARGE);
+
+    return 0;
+}
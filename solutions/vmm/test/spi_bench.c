@@ -0,0 +1,147 @@
+/*
+ * Copyright 2023, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Checks registering SPIs with the vGIC and times injecting them, for
+ * different numbers of registered SPIs. Injecting an SPI looks it up through
+ * vspi_slots, so it should cost the same however many SPIs there are. The
+ * search of the slot list that the lookup replaced is timed alongside for
+ * comparison.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "stubs.h"
+#include "../src/util/util.h"
+#include "../src/vgic/vgic.h"
+#include "../src/vgic/virq.h"
+#include "../src/vgic/vgic_v2.h"
+#include "../src/vgic/vdist.h"
+
+extern vgic_t vgic;
+
+#define ITERATIONS 1000000
+
+static const int num_spis[] = { 1, 8, 32, 100, NUM_SLOTS_SPI_VIRQ };
+
+static int failures;
+
+#define CHECK(expr) \
+    do { \
+        if (!(expr)) { \
+            printf("FAIL: %s at line %d\n", #expr, __LINE__); \
+            failures++; \
+        } \
+    } while (0)
+
+static void irq_ack(uint64_t vcpu_id, int irq, void *cookie)
+{
+    microkit_irq_ack(0);
+}
+
+/* Spread the SPIs over the whole range, so lookups are not all at the start of the table */
+static int spi_irq(int i, int n)
+{
+    return NUM_VCPU_LOCAL_VIRQS + i * (NUM_SPI_VIRQS / n);
+}
+
+/* How SPIs were found before vspi_slots */
+static struct virq_handle *spi_search(vgic_t *vgic, int virq)
+{
+    for (int i = 0; i < ARRAY_SIZE(vgic->vspis); i++) {
+        if (vgic->vspis[i].virq == virq) {
+            return &vgic->vspis[i];
+        }
+    }
+    return NULL;
+}
+
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void setup(int n)
+{
+    stub_reset();
+    vgic_init();
+    struct gic_dist_map *dist = vgic_get_dist(vgic.registers);
+    vgic_dist_enable(dist);
+    for (int i = 0; i < n; i++) {
+        int irq = spi_irq(i, n);
+        CHECK(vgic_register_irq(GUEST_BOOT_VCPU_ID, irq, irq_ack, NULL));
+        set_enable(dist, irq, true, GUEST_BOOT_VCPU_ID);
+    }
+}
+
+static void test_register(void)
+{
+    setup(NUM_SLOTS_SPI_VIRQ);
+    for (int i = 0; i < NUM_SLOTS_SPI_VIRQ; i++) {
+        int irq = spi_irq(i, NUM_SLOTS_SPI_VIRQ);
+        struct virq_handle *virq = virq_find_irq_data(&vgic, GUEST_BOOT_VCPU_ID, irq);
+        CHECK(virq && virq->virq == irq);
+        CHECK(virq == spi_search(&vgic, irq));
+        /* The IRQ just after is never registered */
+        CHECK(virq_find_irq_data(&vgic, GUEST_BOOT_VCPU_ID, irq + 1) == NULL);
+    }
+    /* Registering twice, past the slots and outside the SPIs are refused */
+    CHECK(!vgic_register_irq(GUEST_BOOT_VCPU_ID, spi_irq(0, NUM_SLOTS_SPI_VIRQ), irq_ack, NULL));
+    CHECK(!vgic_register_irq(GUEST_BOOT_VCPU_ID, spi_irq(0, NUM_SLOTS_SPI_VIRQ) + 1, irq_ack, NULL));
+    CHECK(!vgic_register_irq(GUEST_BOOT_VCPU_ID, NUM_VCPU_LOCAL_VIRQS + NUM_SPI_VIRQS, irq_ack, NULL));
+    CHECK(virq_find_irq_data(&vgic, GUEST_BOOT_VCPU_ID, NUM_VCPU_LOCAL_VIRQS + NUM_SPI_VIRQS) == NULL);
+}
+
+static void bench(int n)
+{
+    setup(n);
+    /* The last one registered is the furthest into the slot list */
+    int irq = spi_irq(n - 1, n);
+    struct stub_vcpu *v = &stub_vcpus[GUEST_BOOT_VCPU_ID];
+
+    volatile uintptr_t sink = 0;
+    uint64_t start = time_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        sink += (uintptr_t)virq_find_irq_data(&vgic, GUEST_BOOT_VCPU_ID, irq);
+    }
+    uint64_t lookup = time_ns() - start;
+
+    start = time_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        sink += (uintptr_t)spi_search(&vgic, irq);
+    }
+    uint64_t search = time_ns() - start;
+
+    /* Inject it and have the guest EOI it, the way the serial IRQ goes */
+    start = time_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        vgic_inject_irq(GUEST_BOOT_VCPU_ID, irq);
+        v->lr[0] = STUB_LR_EMPTY;
+        microkit_mr_set(seL4_VGICMaintenance_IDX, 0);
+        handle_vgic_maintenance(GUEST_BOOT_VCPU_ID);
+    }
+    uint64_t inject = time_ns() - start;
+    CHECK(stub_irq_acks == ITERATIONS);
+
+    printf("BENCH: %3d SPIs registered: lookup %5.1f ns, slot list search %6.1f ns, inject and EOI %6.1f ns\n",
+           n, (double)lookup / ITERATIONS, (double)search / ITERATIONS, (double)inject / ITERATIONS);
+}
+
+int main(void)
+{
+    test_register();
+    if (failures) {
+        return 1;
+    }
+    printf("PASS: SPI registration\n");
+    for (int i = 0; i < ARRAY_SIZE(num_spis); i++) {
+        bench(num_spis[i]);
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2023, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * What the VMM gets from Microkit and seL4, for running parts of it on the
+ * host. The vCPUs' list registers and TCB registers are kept here so that the
+ * tests can see what the VMM did with them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "stubs.h"
+
+char microkit_name[16] = "VMM";
+
+struct stub_vcpu stub_vcpus[STUB_NUM_VCPUS];
+int stub_num_list_regs = STUB_NUM_LIST_REGS_DEFAULT;
+uint64_t stub_irq_acks;
+uint64_t stub_tcb_reads;
+uint64_t stub_tcb_writes;
+uint64_t stub_tcb_regs_read;
+uint64_t stub_tcb_regs_written;
+uint64_t stub_dc_zva_calls;
+
+static seL4_Word mrs[seL4_UnknownSyscall_Length];
+static size_t zva_block_size = STUB_DC_ZVA_BLOCK_SIZE;
+
+void stub_reset(void)
+{
+    for (int i = 0; i < STUB_NUM_VCPUS; i++) {
+        for (int j = 0; j < STUB_MAX_LIST_REGS; j++) {
+            stub_vcpus[i].lr[j] = STUB_LR_EMPTY;
+        }
+    }
+    stub_irq_acks = 0;
+    stub_tcb_reads = 0;
+    stub_tcb_writes = 0;
+    stub_tcb_regs_read = 0;
+    stub_tcb_regs_written = 0;
+    stub_dc_zva_calls = 0;
+}
+
+static struct stub_vcpu *stub_vcpu_from_cap(seL4_CPtr cap, seL4_CPtr base)
+{
+    if (cap < base || cap - base >= STUB_NUM_VCPUS) {
+        fprintf(stderr, "stub: invalid capability %lu\n", cap);
+        abort();
+    }
+    return &stub_vcpus[cap - base];
+}
+
+void microkit_dbg_putc(int c)
+{
+    putchar(c);
+}
+
+void microkit_dbg_puts(const char *s)
+{
+    fputs(s, stdout);
+}
+
+void microkit_irq_ack(microkit_channel ch)
+{
+    stub_irq_acks++;
+}
+
+void microkit_mr_set(seL4_Uint8 mr, seL4_Word value)
+{
+    mrs[mr] = value;
+}
+
+seL4_Word microkit_mr_get(seL4_Uint8 mr)
+{
+    return mrs[mr];
+}
+
+seL4_Word seL4_GetMR(int i)
+{
+    return mrs[i];
+}
+
+void seL4_Send(seL4_CPtr dest, microkit_msginfo msginfo)
+{
+}
+
+seL4_Word microkit_vcpu_arm_read_reg(microkit_child vcpu, seL4_Word reg)
+{
+    return 0;
+}
+
+void microkit_vcpu_arm_inject_irq(microkit_child vcpu, seL4_Uint16 irq, seL4_Uint8 priority,
+                                  seL4_Uint8 group, seL4_Uint8 index)
+{
+    seL4_ARM_VCPU_InjectIRQ(BASE_VCPU_CAP + vcpu, irq, priority, group, index);
+}
+
+/* Like the kernel, an index past the last list register is a range error holding the valid indexes. */
+seL4_Error seL4_ARM_VCPU_InjectIRQ(seL4_CPtr vcpu, seL4_Uint16 virq, seL4_Uint8 priority,
+                                   seL4_Uint8 group, seL4_Uint8 index)
+{
+    struct stub_vcpu *v = stub_vcpu_from_cap(vcpu, BASE_VCPU_CAP);
+    if (index >= stub_num_list_regs) {
+        mrs[0] = 0;
+        mrs[1] = stub_num_list_regs - 1;
+        return seL4_RangeError;
+    }
+    v->lr[index] = virq;
+
+    return seL4_NoError;
+}
+
+seL4_Error seL4_TCB_ReadRegisters(seL4_CPtr tcb, seL4_Bool suspend_source, seL4_Uint8 arch_flags,
+                                  seL4_Word count, seL4_UserContext *regs)
+{
+    struct stub_vcpu *v = stub_vcpu_from_cap(tcb, BASE_VM_TCB_CAP);
+    for (seL4_Word i = 0; i < count; i++) {
+        ((seL4_Word *)regs)[i] = ((seL4_Word *)&v->regs)[i];
+    }
+    stub_tcb_reads++;
+    stub_tcb_regs_read += count;
+
+    return seL4_NoError;
+}
+
+seL4_Error seL4_TCB_WriteRegisters(seL4_CPtr tcb, seL4_Bool resume_target, seL4_Uint8 arch_flags,
+                                   seL4_Word count, seL4_UserContext *regs)
+{
+    struct stub_vcpu *v = stub_vcpu_from_cap(tcb, BASE_VM_TCB_CAP);
+    for (seL4_Word i = 0; i < count; i++) {
+        ((seL4_Word *)&v->regs)[i] = ((seL4_Word *)regs)[i];
+    }
+    stub_tcb_writes++;
+    stub_tcb_regs_written += count;
+
+    return seL4_NoError;
+}
+
+void stub_set_dc_zva_block_size(size_t block_size)
+{
+    zva_block_size = block_size;
+}
+
+size_t dc_zva_block_size(void)
+{
+    return zva_block_size;
+}
+
+/* DC ZVA zeroes the whole block, the VMM only ever gives it aligned addresses */
+void dc_zva(void *p)
+{
+    if (zva_block_size == 0 || ((uintptr_t)p & (zva_block_size - 1)) != 0) {
+        fprintf(stderr, "stub: DC ZVA of %p with a block size of %zu\n", p, zva_block_size);
+        abort();
+    }
+    stub_dc_zva_calls++;
+    volatile uint64_t *w = p;
+    for (size_t i = 0; i < zva_block_size / sizeof(uint64_t); i++) {
+        w[i] = 0;
+    }
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright 2023, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <microkit.h>
+
+#define STUB_NUM_VCPUS 2
+/* As many as the architecture allows */
+#define STUB_MAX_LIST_REGS 16
+/* What QEMU's GIC has */
+#define STUB_NUM_LIST_REGS_DEFAULT 4
+#define STUB_DC_ZVA_BLOCK_SIZE 64
+
+#define STUB_LR_EMPTY -1
+
+struct stub_vcpu {
+    /* The IRQ in each list register, STUB_LR_EMPTY if there is none */
+    int lr[STUB_MAX_LIST_REGS];
+    seL4_UserContext regs;
+};
+
+extern struct stub_vcpu stub_vcpus[STUB_NUM_VCPUS];
+/* How many list registers the GIC reports, set before initialising the vGIC */
+extern int stub_num_list_regs;
+/* How many times each of these was called since stub_reset() */
+extern uint64_t stub_irq_acks;
+extern uint64_t stub_tcb_reads;
+extern uint64_t stub_tcb_writes;
+/* and how many registers those TCB calls transferred */
+extern uint64_t stub_tcb_regs_read;
+extern uint64_t stub_tcb_regs_written;
+extern uint64_t stub_dc_zva_calls;
+
+void stub_reset(void);
+/* 0 prohibits DC ZVA, as DCZID_EL0.DZP does */
+void stub_set_dc_zva_block_size(size_t block_size);
@@ -0,0 +1,290 @@
+/*
+ * Copyright 2023, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Replays a trace of what a guest does with the virtual GIC through the vGIC
+ * driver, to check what it does and time it without booting a guest.
+ *
+ * A trace has one event per line, '#' starts a comment. Numbers can be given
+ * in decimal or, starting with 0x, in hex.
+ *
+ *   reg <vcpu> <irq>               register an IRQ with the vGIC, as the VMM does at start-up
+ *   r <vcpu> <offset> [<expected>] guest reads a distributor register
+ *   w <vcpu> <offset> <value>      guest writes a distributor register
+ *   i <vcpu> <irq>                 the IRQ arrives and is injected
+ *   e <vcpu> <irq>                 guest EOIs the IRQ, giving a maintenance fault
+ *
+ * All accesses are 32 bits wide. The trace is replayed a number of times from
+ * a freshly initialised vGIC, and the time taken by each kind of event is
+ * reported along with the longest the IRQ queue of each vCPU got.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "stubs.h"
+#include "../src/util/util.h"
+#include "../src/fault.h"
+#include "../src/hsr.h"
+#include "../src/vgic/vgic.h"
+#include "../src/vgic/virq.h"
+
+extern vgic_t vgic;
+
+#define DEFAULT_ITERATIONS 10000
+#define MAX_EVENTS 4096
+#define MAX_LINE 256
+
+/* x1 holds the data of every access */
+#define TRACE_RT 1
+#define TRACE_FSR_READ (HSR_SYNDROME_VALID | (2 << 22) | (TRACE_RT << 16))
+#define TRACE_FSR_WRITE (TRACE_FSR_READ | (1 << 6))
+
+enum event_type {
+    EVENT_REGISTER,
+    EVENT_READ,
+    EVENT_WRITE,
+    EVENT_INJECT,
+    EVENT_EOI,
+    EVENT_NUM,
+};
+
+static const char *event_names[EVENT_NUM] = {
+    [EVENT_REGISTER] = "register",
+    [EVENT_READ] = "distributor read",
+    [EVENT_WRITE] = "distributor write",
+    [EVENT_INJECT] = "inject",
+    [EVENT_EOI] = "EOI/maintenance",
+};
+
+struct event {
+    enum event_type type;
+    uint64_t vcpu;
+    uint64_t arg;
+    uint64_t value;
+    bool check;
+    int line;
+};
+
+static struct event events[MAX_EVENTS];
+static int num_events;
+
+static uint64_t event_ns[EVENT_NUM];
+static uint64_t event_count[EVENT_NUM];
+static uint64_t peak_queue_len[STUB_NUM_VCPUS];
+static int failures;
+
+static void irq_ack(uint64_t vcpu_id, int irq, void *cookie)
+{
+    microkit_irq_ack((microkit_channel)(uintptr_t)cookie);
+}
+
+static bool parse_trace(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+
+    char line[MAX_LINE];
+    int line_num = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_num++;
+        for (char *c = line; *c; c++) {
+            if (*c == '#') {
+                *c = '\0';
+                break;
+            }
+        }
+
+        char op[8];
+        unsigned long long vcpu, arg, value;
+        int n = sscanf(line, "%7s %lli %lli %lli", op, &vcpu, &arg, &value);
+        if (n <= 0) {
+            continue;
+        }
+        if (num_events == MAX_EVENTS) {
+            fprintf(stderr, "%s:%d: more than %d events\n", path, line_num, MAX_EVENTS);
+            fclose(f);
+            return false;
+        }
+
+        struct event *e = &events[num_events];
+        bool valid = n >= 3 && vcpu < STUB_NUM_VCPUS;
+        if (op[0] == 'r' && op[1] == 'e' && op[2] == 'g' && op[3] == '\0') {
+            e->type = EVENT_REGISTER;
+        } else if (op[0] == 'r' && op[1] == '\0') {
+            e->type = EVENT_READ;
+            e->check = (n == 4);
+        } else if (op[0] == 'w' && op[1] == '\0') {
+            e->type = EVENT_WRITE;
+            valid = valid && n == 4;
+        } else if (op[0] == 'i' && op[1] == '\0') {
+            e->type = EVENT_INJECT;
+        } else if (op[0] == 'e' && op[1] == '\0') {
+            e->type = EVENT_EOI;
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            fprintf(stderr, "%s:%d: malformed event\n", path, line_num);
+            fclose(f);
+            return false;
+        }
+        e->vcpu = vcpu;
+        e->arg = arg;
+        e->value = value;
+        e->line = line_num;
+        num_events++;
+    }
+
+    fclose(f);
+    return true;
+}
+
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* What a pair of time_ns() calls costs, taken off every measurement */
+static uint64_t time_overhead(void)
+{
+    uint64_t start = time_ns();
+    for (int i = 0; i < 1000; i++) {
+        time_ns();
+    }
+    return (time_ns() - start) / 1000;
+}
+
+static void dist_access(struct event *e, uint64_t fsr)
+{
+    microkit_msginfo reply;
+    struct fault_ctx *ctx = fault_ctx_begin(e->vcpu, seL4_Fault_VMFault);
+    handle_vgic_dist_fault(e->vcpu, GIC_DIST_PADDR + e->arg, fsr, ctx);
+    fault_ctx_commit(ctx, &reply);
+}
+
+static bool replay_event(struct event *e, uint64_t overhead)
+{
+    struct stub_vcpu *v = &stub_vcpus[e->vcpu];
+    uint64_t start, end;
+    bool success = true;
+
+    switch (e->type) {
+    case EVENT_REGISTER:
+        start = time_ns();
+        success = vgic_register_irq(e->vcpu, e->arg, irq_ack, (void *)(uintptr_t)e->arg);
+        end = time_ns();
+        break;
+    case EVENT_READ:
+        start = time_ns();
+        dist_access(e, TRACE_FSR_READ);
+        end = time_ns();
+        if (e->check && (uint32_t)v->regs.x1 != (uint32_t)e->value) {
+            fprintf(stderr, "line %d: read 0x%x from 0x%lx, expected 0x%x\n",
+                    e->line, (uint32_t)v->regs.x1, e->arg, (uint32_t)e->value);
+            success = false;
+        }
+        break;
+    case EVENT_WRITE:
+        v->regs.x1 = e->value;
+        start = time_ns();
+        dist_access(e, TRACE_FSR_WRITE);
+        end = time_ns();
+        break;
+    case EVENT_INJECT:
+        start = time_ns();
+        vgic_inject_irq(e->vcpu, e->arg);
+        end = time_ns();
+        break;
+    case EVENT_EOI: {
+        int idx = -1;
+        for (int i = 0; i < stub_num_list_regs; i++) {
+            if (v->lr[i] == e->arg) {
+                idx = i;
+                break;
+            }
+        }
+        if (idx < 0) {
+            fprintf(stderr, "line %d: IRQ %lu is not in a list register of vCPU %lu\n", e->line, e->arg, e->vcpu);
+            return false;
+        }
+        v->lr[idx] = STUB_LR_EMPTY;
+        microkit_mr_set(seL4_VGICMaintenance_IDX, idx);
+        start = time_ns();
+        success = handle_vgic_maintenance(e->vcpu);
+        end = time_ns();
+        break;
+    }
+    default:
+        return false;
+    }
+
+    uint64_t elapsed = end - start;
+    event_ns[e->type] += elapsed > overhead ? elapsed - overhead : 0;
+    event_count[e->type]++;
+    for (int i = 0; i < STUB_NUM_VCPUS; i++) {
+        uint64_t len = vgic.vgic_vcpu[i].irq_queue.len;
+        if (len > peak_queue_len[i]) {
+            peak_queue_len[i] = len;
+        }
+    }
+    if (!success) {
+        fprintf(stderr, "line %d: %s failed\n", e->line, event_names[e->type]);
+    }
+
+    return success;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s <trace> [<iterations>]\n", argv[0]);
+        return 1;
+    }
+    int iterations = argc == 3 ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+    if (!parse_trace(argv[1]) || iterations <= 0) {
+        return 1;
+    }
+
+    uint64_t overhead = time_overhead();
+    for (int it = 0; it < iterations && failures == 0; it++) {
+        stub_reset();
+        vgic_init();
+        for (int i = 0; i < num_events; i++) {
+            if (!replay_event(&events[i], overhead)) {
+                failures++;
+                break;
+            }
+        }
+    }
+    if (failures) {
+        printf("FAIL: %s\n", argv[1]);
+        return 1;
+    }
+
+    printf("PASS: %s, %d events, %d iterations, %d list registers\n", argv[1], num_events, iterations,
+           vgic.num_list_regs);
+    for (int i = 0; i < EVENT_NUM; i++) {
+        if (event_count[i] != 0) {
+            printf("BENCH: %-18s %10lu calls %8.1f ns each\n", event_names[i], event_count[i],
+                   (double)event_ns[i] / event_count[i]);
+        }
+    }
+    for (int i = 0; i < STUB_NUM_VCPUS; i++) {
+        printf("BENCH: vCPU %d peak IRQ queue depth %lu (of %d)\n", i, peak_queue_len[i], MAX_IRQ_QUEUE_LEN);
+    }
+    printf("BENCH: IRQ acks %lu, TCB register reads %lu (%lu registers), writes %lu (%lu registers) (last iteration)\n",
+           stub_irq_acks, stub_tcb_reads, stub_tcb_regs_read, stub_tcb_writes, stub_tcb_regs_written);
+    /* Counted by the driver itself, also for the last iteration only */
+    vgic_print_stats();
+
+    return 0;
+}
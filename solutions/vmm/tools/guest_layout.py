@@ -0,0 +1,344 @@
+#!/usr/bin/env python3
+#
+# Copyright 2023, UNSW (ABN 57 195 873 179)
+#
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# Works out where the VMM places the guest's images in guest RAM, so that the
+# VMM does not need any hard-coded addresses or run-time DTB parsing.
+#
+# Guest RAM is found from the virtual machine's mapping in the system
+# description. The kernel goes at text_offset from the start of RAM, as the
+# Linux arm64 boot protocol requires. The initial RAM disk goes right after the
+# space the kernel says it needs (image_size), and the DTB after that on its
+# own 2MiB block. The /memory node and the initrd bounds in /chosen of the
+# input DTB are updated to match, and the addresses are written to a header
+# for the VMM. On a uniprocessor seL4 kernel the VMM only gives the guest its
+# boot vCPU, so the other CPU nodes are removed from the DTB.
+#
+# The VMM keeps a copy of the images in a snapshot memory region to restart
+# the guest from. That region is sized here to just fit the images, in a copy
+# of the system description that the image is then built from.
+#
+# Only the Python standard library is used.
+
+import argparse
+import os
+import re
+import struct
+import sys
+import xml.etree.ElementTree as ET
+
+# https://www.kernel.org/doc/Documentation/arm64/booting.txt
+LINUX_IMAGE_MAGIC = 0x644d5241
+LINUX_IMAGE_HEADER_FORMAT = "<IIQQQQQQII"
+DTB_ALIGN = 0x200000
+DTB_MAX_SIZE = 0x200000
+INITRD_ALIGN = 0x1000
+
+# https://devicetree-specification.readthedocs.io, chapter 5
+FDT_MAGIC = 0xd00dfeed
+FDT_HEADER_FORMAT = ">10I"
+FDT_BEGIN_NODE = 0x1
+FDT_END_NODE = 0x2
+FDT_PROP = 0x3
+FDT_NOP = 0x4
+FDT_END = 0x9
+
+
+class LayoutError(Exception):
+    pass
+
+
+def align_up(value, align):
+    return (value + align - 1) & ~(align - 1)
+
+
+class FdtNode:
+    def __init__(self, name):
+        self.name = name
+        self.props = {}
+        self.children = []
+
+    def child(self, name):
+        for c in self.children:
+            if c.name == name:
+                return c
+        return None
+
+    def cells(self, name, default):
+        value = self.props.get(name)
+        if value is None:
+            return default
+        return struct.unpack(">I", value)[0]
+
+
+class Fdt:
+    def __init__(self, blob):
+        header = struct.unpack_from(FDT_HEADER_FORMAT, blob)
+        (magic, _, off_struct, off_strings, off_rsvmap, version, _,
+         self.boot_cpuid_phys, size_strings, size_struct) = header
+        if magic != FDT_MAGIC:
+            raise LayoutError("not a flattened device tree")
+        if version < 17:
+            raise LayoutError(f"device tree version {version} is not supported")
+
+        self.reservations = []
+        offset = off_rsvmap
+        while True:
+            address, size = struct.unpack_from(">QQ", blob, offset)
+            offset += 16
+            if address == 0 and size == 0:
+                break
+            self.reservations.append((address, size))
+
+        strings = blob[off_strings:off_strings + size_strings]
+        self.root = None
+        stack = []
+        offset = off_struct
+        end = off_struct + size_struct
+        while offset < end:
+            token, = struct.unpack_from(">I", blob, offset)
+            offset += 4
+            if token == FDT_BEGIN_NODE:
+                name_end = blob.index(b"\0", offset)
+                node = FdtNode(blob[offset:name_end].decode())
+                offset = align_up(name_end + 1, 4)
+                if stack:
+                    stack[-1].children.append(node)
+                else:
+                    self.root = node
+                stack.append(node)
+            elif token == FDT_END_NODE:
+                stack.pop()
+            elif token == FDT_PROP:
+                length, name_offset = struct.unpack_from(">II", blob, offset)
+                offset += 8
+                name = strings[name_offset:strings.index(b"\0", name_offset)].decode()
+                stack[-1].props[name] = blob[offset:offset + length]
+                offset = align_up(offset + length, 4)
+            elif token == FDT_NOP:
+                pass
+            elif token == FDT_END:
+                break
+            else:
+                raise LayoutError(f"unknown device tree token 0x{token:x}")
+        if self.root is None or stack:
+            raise LayoutError("malformed device tree structure block")
+
+    def pack(self):
+        structure = bytearray()
+        strings = bytearray()
+        string_offsets = {}
+
+        def string_offset(name):
+            if name not in string_offsets:
+                string_offsets[name] = len(strings)
+                strings.extend(name.encode() + b"\0")
+            return string_offsets[name]
+
+        def pack_node(node):
+            structure.extend(struct.pack(">I", FDT_BEGIN_NODE))
+            structure.extend(node.name.encode() + b"\0")
+            structure.extend(b"\0" * (align_up(len(structure), 4) - len(structure)))
+            for name, value in node.props.items():
+                structure.extend(struct.pack(">III", FDT_PROP, len(value), string_offset(name)))
+                structure.extend(value)
+                structure.extend(b"\0" * (align_up(len(structure), 4) - len(structure)))
+            for c in node.children:
+                pack_node(c)
+            structure.extend(struct.pack(">I", FDT_END_NODE))
+
+        pack_node(self.root)
+        structure.extend(struct.pack(">I", FDT_END))
+
+        rsvmap = b"".join(struct.pack(">QQ", a, s) for a, s in self.reservations + [(0, 0)])
+        off_rsvmap = align_up(struct.calcsize(FDT_HEADER_FORMAT), 8)
+        off_struct = off_rsvmap + len(rsvmap)
+        off_strings = off_struct + len(structure)
+        total_size = off_strings + len(strings)
+        header = struct.pack(FDT_HEADER_FORMAT, FDT_MAGIC, total_size, off_struct, off_strings,
+                             off_rsvmap, 17, 16, self.boot_cpuid_phys, len(strings), len(structure))
+        padding = b"\0" * (off_rsvmap - len(header))
+        return header + padding + rsvmap + bytes(structure) + bytes(strings)
+
+
+def encode_cells(value, cells):
+    return b"".join(struct.pack(">I", (value >> (32 * i)) & 0xffffffff) for i in reversed(range(cells)))
+
+
+def parse_number(value):
+    # The Microkit tool allows underscores to separate digits
+    return int(value.replace("_", ""), 0)
+
+
+def format_number(value):
+    # Written the way the system description writes sizes, e.g 0x200_000
+    digits = f"{value:x}"
+    groups = []
+    while digits:
+        groups.insert(0, digits[-3:])
+        digits = digits[:-3]
+    return "0x" + "_".join(groups)
+
+
+def guest_ram_from_system(path, vm_name, ram_mr):
+    system = ET.parse(path).getroot()
+    regions = {mr.get("name"): mr for mr in system.iter("memory_region")}
+    if ram_mr not in regions:
+        raise LayoutError(f"{path}: no memory region named '{ram_mr}'")
+    ram_size = parse_number(regions[ram_mr].get("size"))
+
+    for pd in system.iter("protection_domain"):
+        vm = pd.find(f"virtual_machine[@name='{vm_name}']")
+        if vm is None:
+            continue
+        vm_map = vm.find(f"map[@mr='{ram_mr}']")
+        if vm_map is None:
+            raise LayoutError(f"{path}: '{ram_mr}' is not mapped into virtual machine '{vm_name}'")
+        ram_vaddr = parse_number(vm_map.get("vaddr"))
+        # The VMM writes the images through its own mapping of guest RAM using
+        # the guest's addresses, so both need to be the same.
+        vmm_map = pd.find(f"map[@mr='{ram_mr}']")
+        if vmm_map is None or parse_number(vmm_map.get("vaddr")) != ram_vaddr:
+            raise LayoutError(f"{path}: '{ram_mr}' must be mapped into the VMM at 0x{ram_vaddr:x}, "
+                              f"the same address as in the virtual machine")
+        return ram_vaddr, ram_size
+
+    raise LayoutError(f"{path}: no virtual machine named '{vm_name}'")
+
+
+def snapshot_region(path, snapshot_mr):
+    system = ET.parse(path).getroot()
+    for mr in system.iter("memory_region"):
+        if mr.get("name") == snapshot_mr:
+            return parse_number(mr.get("page_size", "0x1000"))
+    raise LayoutError(f"{path}: no memory region named '{snapshot_mr}'")
+
+
+def write_sized_system(path, out_path, snapshot_mr, snapshot_size):
+    # The system description is edited as text so that its comments and
+    # formatting are kept.
+    with open(path) as f:
+        system = f.read()
+    region = re.compile(r'<memory_region\b[^>]*\bname="' + re.escape(snapshot_mr) + r'"[^>]*>')
+    match = region.search(system)
+    if match is None:
+        raise LayoutError(f"{path}: could not find the '{snapshot_mr}' memory region")
+    sized, count = re.subn(r'\bsize="[^"]*"', f'size="{format_number(snapshot_size)}"', match.group(0))
+    if count != 1:
+        raise LayoutError(f"{path}: '{snapshot_mr}' memory region does not have a size")
+    with open(out_path, "w") as f:
+        f.write(system[:match.start()] + sized + system[match.end():])
+
+
+def kernel_max_num_nodes(path):
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) == 3 and fields[:2] == ["#define", "CONFIG_MAX_NUM_NODES"]:
+                return parse_number(fields[2])
+    raise LayoutError(f"{path}: CONFIG_MAX_NUM_NODES is not defined")
+
+
+def kernel_layout(path):
+    with open(path, "rb") as f:
+        header = f.read(struct.calcsize(LINUX_IMAGE_HEADER_FORMAT))
+    if len(header) < struct.calcsize(LINUX_IMAGE_HEADER_FORMAT):
+        raise LayoutError(f"{path}: too small to be a Linux kernel image")
+    fields = struct.unpack(LINUX_IMAGE_HEADER_FORMAT, header)
+    text_offset, image_size, magic = fields[2], fields[3], fields[8]
+    if magic != LINUX_IMAGE_MAGIC:
+        raise LayoutError(f"{path}: Linux kernel image magic check failed")
+    if image_size == 0:
+        raise LayoutError(f"{path}: kernel is too old to state its image size")
+    return text_offset, image_size
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Lay out the guest images in guest RAM")
+    parser.add_argument("--system", required=True, help="Microkit system description")
+    parser.add_argument("--vm", required=True, help="name of the virtual machine in the system description")
+    parser.add_argument("--ram-mr", required=True, help="memory region that is the guest's RAM")
+    parser.add_argument("--kernel", required=True, help="uncompressed Linux kernel image")
+    parser.add_argument("--initrd", required=True, help="initial RAM disk")
+    parser.add_argument("--dtb", required=True, help="guest device tree to update")
+    parser.add_argument("--kernel-config", required=True, help="seL4 kernel configuration header (gen_config.h)")
+    parser.add_argument("--snapshot-mr", required=True, help="memory region the VMM keeps a copy of the images in")
+    parser.add_argument("--out-dtb", required=True)
+    parser.add_argument("--out-header", required=True)
+    parser.add_argument("--out-system", required=True, help="system description with the snapshot region sized")
+    args = parser.parse_args()
+
+    ram_vaddr, ram_size = guest_ram_from_system(args.system, args.vm, args.ram_mr)
+    snapshot_page_size = snapshot_region(args.system, args.snapshot_mr)
+    # The kernel has to be at text_offset from a 2MiB aligned address.
+    if ram_vaddr % 0x200000 != 0:
+        raise LayoutError(f"guest RAM at 0x{ram_vaddr:x} is not 2MiB aligned")
+    text_offset, kernel_size = kernel_layout(args.kernel)
+    initrd_size = os.path.getsize(args.initrd)
+    with open(args.dtb, "rb") as f:
+        fdt = Fdt(f.read())
+
+    kernel_vaddr = ram_vaddr + text_offset
+    initrd_vaddr = align_up(kernel_vaddr + kernel_size, INITRD_ALIGN)
+    initrd_end = initrd_vaddr + initrd_size
+    dtb_vaddr = align_up(initrd_end, DTB_ALIGN)
+
+    address_cells = fdt.root.cells("#address-cells", 2)
+    size_cells = fdt.root.cells("#size-cells", 1)
+    memory = [n for n in fdt.root.children if n.props.get("device_type") == b"memory\0"]
+    if len(memory) != 1:
+        raise LayoutError(f"{args.dtb}: expected exactly one memory node, found {len(memory)}")
+    memory[0].name = f"memory@{ram_vaddr:x}"
+    memory[0].props["reg"] = encode_cells(ram_vaddr, address_cells) + encode_cells(ram_size, size_cells)
+
+    if kernel_max_num_nodes(args.kernel_config) <= 1:
+        cpus = fdt.root.child("cpus")
+        if cpus is None:
+            raise LayoutError(f"{args.dtb}: no /cpus node")
+        cpus.children = [c for c in cpus.children
+                         if c.props.get("device_type") != b"cpu\0" or c.cells("reg", 0) == 0]
+
+    chosen = fdt.root.child("chosen")
+    if chosen is None:
+        chosen = FdtNode("chosen")
+        fdt.root.children.append(chosen)
+    chosen.props["linux,initrd-start"] = encode_cells(initrd_vaddr, 2)
+    chosen.props["linux,initrd-end"] = encode_cells(initrd_end, 2)
+
+    dtb = fdt.pack()
+    if len(dtb) > DTB_MAX_SIZE:
+        raise LayoutError(f"{args.dtb}: DTB is 0x{len(dtb):x} bytes, at most 0x{DTB_MAX_SIZE:x} is allowed")
+    if dtb_vaddr + len(dtb) > ram_vaddr + ram_size:
+        raise LayoutError(f"guest images need 0x{dtb_vaddr + len(dtb) - ram_vaddr:x} bytes of RAM, "
+                          f"but '{args.ram_mr}' is only 0x{ram_size:x} bytes")
+    # The decompressed kernel is never bigger than the image size it states.
+    snapshot_size = align_up(kernel_size + initrd_size + len(dtb), snapshot_page_size)
+
+    with open(args.out_dtb, "wb") as f:
+        f.write(dtb)
+    write_sized_system(args.system, args.out_system, args.snapshot_mr, snapshot_size)
+    with open(args.out_header, "w") as f:
+        f.write("/* Generated by guest_layout.py, do not edit. */\n")
+        f.write("#pragma once\n\n")
+        for name, value in [
+            ("GUEST_RAM_VADDR", ram_vaddr),
+            ("GUEST_RAM_SIZE", ram_size),
+            ("GUEST_KERNEL_VADDR", kernel_vaddr),
+            ("GUEST_KERNEL_SIZE", kernel_size),
+            ("GUEST_INIT_RAM_DISK_VADDR", initrd_vaddr),
+            ("GUEST_INIT_RAM_DISK_SIZE", initrd_size),
+            ("GUEST_DTB_VADDR", dtb_vaddr),
+            ("GUEST_DTB_SIZE", len(dtb)),
+            ("GUEST_SNAPSHOT_SIZE", snapshot_size),
+        ]:
+            f.write(f"#define {name} 0x{value:x}\n")
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except (LayoutError, OSError, ET.ParseError) as e:
+        print(f"guest_layout.py: error: {e}", file=sys.stderr)
+        sys.exit(1)
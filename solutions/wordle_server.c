@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include "printf.h"
 #include "wordle.h"
+#include "dictionary.h"
 
 /*
  * Here we initialise the word to "hello", but later in the tutorial
@@ -14,28 +15,100 @@ char word[WORD_LENGTH] = { 'h', 'e', 'l', 'l', 'o' };
 #define CLIENT_CHANNEL 1
 #define VMM_CHANNEL 2
 
-bool is_character_in_word(char *word, int ch) {
+static int char_to_lower(int ch) {
+    if (ch >= 'A' && ch <= 'Z') {
+        return ch - 'A' + 'a';
+    }
+    return ch;
+}
+
+#define NUM_LETTERS 26
+
+/*
+ * How many times each letter appears in the word. This only changes when the
+ * word does, so we work it out once then rather than for every guess.
+ */
+static uint8_t word_letter_count[NUM_LETTERS];
+
+static int letter_index(int ch) {
+    ch = char_to_lower(ch);
+    if (ch < 'a' || ch > 'z') {
+        return -1;
+    }
+    return ch - 'a';
+}
+
+void word_update_letter_count() {
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        word_letter_count[i] = 0;
+    }
     for (int i = 0; i < WORD_LENGTH; i++) {
-        if (word[i] == ch) {
-            return true;
+        int letter = letter_index(word[i]);
+        if (letter >= 0) {
+            word_letter_count[letter]++;
         }
     }
+}
 
-    return false;
+/*
+ * Work out the state of every character in a guess. This follows the same
+ * rules as the real Wordle when it comes to repeated letters: characters in
+ * the correct place are found first, and then each remaining occurrence of a
+ * letter in the word can only mark one other character of the guess as being
+ * in the wrong place. For example, guessing "lllll" when the word is "hello"
+ * gives two correct characters and no characters in the wrong place.
+ */
+void score_guess(char *guess, enum character_state *states) {
+    uint8_t remaining[NUM_LETTERS];
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        remaining[i] = word_letter_count[i];
+    }
+
+    for (int i = 0; i < WORD_LENGTH; i++) {
+        int letter = letter_index(guess[i]);
+        if (letter >= 0 && letter == letter_index(word[i])) {
+            states[i] = CORRECT_PLACEMENT;
+            remaining[letter]--;
+        } else {
+            states[i] = INCORRECT;
+        }
+    }
+
+    for (int i = 0; i < WORD_LENGTH; i++) {
+        int letter = letter_index(guess[i]);
+        if (states[i] == INCORRECT && letter >= 0 && remaining[letter] > 0) {
+            states[i] = INCORRECT_PLACEMENT;
+            remaining[letter]--;
+        }
+    }
 }
 
-enum character_state char_to_state(int ch, char *word, uint64_t index) {
-    if (ch == word[index]) {
-        return CORRECT_PLACEMENT;
-    } else if (is_character_in_word(word, ch)) {
-        return INCORRECT_PLACEMENT;
-    } else {
-        return INCORRECT;
+/*
+ * Check whether a guess is a real word. The dictionary is generated at build
+ * time as a sorted array of words packed 5 bits per letter (see the Makefile),
+ * which is the same way guesses are packed by the client, so all we need to do
+ * is binary search for the packed guess.
+ */
+bool is_word_in_dictionary(uint32_t packed) {
+    size_t low = 0;
+    size_t high = sizeof(dictionary) / sizeof(dictionary[0]);
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (dictionary[mid] < packed) {
+            low = mid + 1;
+        } else if (dictionary[mid] > packed) {
+            high = mid;
+        } else {
+            return true;
+        }
     }
+
+    return false;
 }
 
 void init(void) {
     microkit_dbg_puts("WORDLE SERVER: starting\n");
+    word_update_letter_count();
 }
 
 void notified(microkit_channel channel) {}
@@ -43,17 +116,27 @@ void notified(microkit_channel channel) {}
 microkit_msginfo protected(microkit_channel channel, microkit_msginfo msginfo)
 {
     switch (channel) {
-        case CLIENT_CHANNEL:
-            for (int i = 0; i < WORD_LENGTH; i++) {
-                char ch = microkit_mr_get(i);
-                microkit_mr_set(i, char_to_state(ch, word, i));
+        case CLIENT_CHANNEL: {
+            uint64_t label = microkit_msginfo_get_label(msginfo);
+            if (WORDLE_LABEL_VERSION(label) != WORDLE_PROTOCOL_VERSION ||
+                WORDLE_LABEL_TYPE(label) != WORDLE_REQUEST_GUESS) {
+                return microkit_msginfo_new(WORDLE_REPLY_INVALID_REQUEST, 0);
             }
-            return microkit_msginfo_new(0, WORD_LENGTH);
-            break;
+            uint64_t packed = microkit_mr_get(0);
+            char guess[WORD_LENGTH];
+            if (!wordle_unpack_word(packed, guess) || !is_word_in_dictionary(packed)) {
+                return microkit_msginfo_new(WORDLE_REPLY_INVALID_WORD, 0);
+            }
+            enum character_state states[WORD_LENGTH];
+            score_guess(guess, states);
+            microkit_mr_set(0, wordle_pack_states(states));
+            return microkit_msginfo_new(WORDLE_REPLY_VALID_WORD, 1);
+        }
         case VMM_CHANNEL:
             for (int i = 0; i < WORD_LENGTH; i++) {
                 word[i] = microkit_mr_get(i);
             }
+            word_update_letter_count();
             break;
         default:
             microkit_dbg_puts("ERROR!\n");